@@ -3,22 +3,379 @@
 
 #include <memory>
 #include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
 
-class ago
+#include "ago_config.h"
+
+/* Policies for basic_ago, fixed at compile time so that the choices cost
+ * nothing at run time. ago uses the first of each. */
+
+/* QueuePolicy: the order functions given to go() leave the shared queue,
+ * and whether a pool thread runs the last function it submitted next,
+ * ahead of the queue. Keyed functions are always run in order. */
+template<bool RunNext = true>
+struct ago_fifo_queue
+{
+	static const bool run_next = RunNext;
+
+	/* tasks linked through their next member */
+	template<class Task>
+	struct queue
+	{
+		queue() : head(nullptr), tail(nullptr), count(0) {}
+
+		bool empty() const { return !head; }
+		std::size_t size() const { return count; }
+
+		void push(Task *t)
+		{
+			t->next = nullptr;
+			if(tail) tail->next = t;
+			else head = t;
+			tail = t;
+			++count;
+		}
+
+		Task *pop()
+		{
+			Task *t = head;
+			head = t->next;
+			if(!head) tail = nullptr;
+			--count;
+			return t;
+		}
+
+		Task *head;
+		Task *tail;
+		std::size_t count;
+	};
+};
+
+/* newest first, which keeps recently touched data in cache at the cost of
+ * fairness */
+template<bool RunNext = true>
+struct ago_lifo_queue
+{
+	static const bool run_next = RunNext;
+
+	template<class Task>
+	struct queue
+	{
+		queue() : head(nullptr), count(0) {}
+
+		bool empty() const { return !head; }
+		std::size_t size() const { return count; }
+
+		void push(Task *t)
+		{
+			t->next = head;
+			head = t;
+			++count;
+		}
+
+		Task *pop()
+		{
+			Task *t = head;
+			head = t->next;
+			--count;
+			return t;
+		}
+
+		Task *head;
+		std::size_t count;
+	};
+};
+
+/* WaitPolicy: what a thread with nothing to do does before it parks on
+ * its condition variable. */
+struct ago_park_wait
+{
+	static const std::uint64_t spin_ns = 0;
+};
+
+/* look for work for SpinUs microseconds first, for loads where functions
+ * arrive just after threads run dry */
+template<unsigned SpinUs>
+struct ago_spin_wait
+{
+	static const std::uint64_t spin_ns = SpinUs * (std::uint64_t)1000;
+};
+
+/* TaskPolicy: task records up to BlockSize bytes, the record header
+ * included, come from blocks cached by each pool thread, at most
+ * CacheLimit of them, of which CacheKeep survive the thread parking. A
+ * BlockSize of 0 allocates every record on its own. */
+template<std::size_t BlockSize = 128, std::size_t CacheLimit = 1024, std::size_t CacheKeep = 64>
+struct ago_task_storage
+{
+	static const std::size_t block_size = BlockSize;
+	static const std::size_t cache_limit = CacheLimit;
+	static const std::size_t cache_keep = CacheKeep;
+};
+
+/* StatsPolicy: whether the counters in snapshot() are kept, and whether
+ * track_latency() can turn on the latency histograms. Without them those
+ * parts of snapshot() are zero. */
+struct ago_full_stats
+{
+	static const bool counters = true;
+	static const bool latency = true;
+};
+
+struct ago_no_stats
+{
+	static const bool counters = false;
+	static const bool latency = false;
+};
+
+/* counters for one thread, or summed over several */
+struct ago_worker_stats
+{
+	std::uint64_t submitted;	/* functions given to go() */
+	std::uint64_t executed;		/* functions run */
+	std::uint64_t stolen;		/* taken from another thread's own queue */
+	std::uint64_t parked;		/* times gone to sleep for lack of work */
+	std::uint64_t unparked;		/* times woken up again */
+	std::uint64_t busy_ns;		/* time awake, up to the last park */
+	std::uint64_t idle_ns;		/* time asleep, up to the last wake */
+};
+
+/* percentiles of a latency histogram, accurate to about 6% */
+struct ago_latency
+{
+	std::uint64_t count;
+	std::uint64_t p50_ns;
+	std::uint64_t p99_ns;
+	std::uint64_t p999_ns;
+	std::uint64_t max_ns;
+};
+
+struct ago_stats
+{
+	std::vector<ago_worker_stats> workers;	/* indexed by thread */
+	std::uint64_t external_submitted;	/* go() from outside the pool */
+	std::uint64_t blocking_executed;	/* go_blocking() functions run */
+	ago_worker_stats total;		/* with both of the above */
+	std::size_t queued;		/* functions waiting to run */
+	std::size_t pending;		/* functions not yet finished */
+	int busy;			/* threads not parked */
+	int blocking_threads;		/* threads started for go_blocking() */
+	ago_latency queue_wait;		/* from go() until the function starts */
+	ago_latency run;		/* time spent in the function */
+};
+
+/* The pool, for any choice of policies. Its members are defined in
+ * ago_impl.h, which the library compiles for ago; include that as well to
+ * use another combination, or define AGO_HEADER_ONLY. */
+template<class QueuePolicy, class WaitPolicy, class TaskPolicy, class StatsPolicy>
+class basic_ago
 {
 public:
-	explicit ago(int max_conc);
-	virtual ~ago();
+	explicit basic_ago(int max_conc);
+
+	/* max_spare: threads this object may add to the max_conc, both spares
+	 * for threads in a blocking_region and threads for go_blocking(); the
+	 * one argument form allows max_conc of them. A max_conc below 1 is
+	 * taken as 1, a max_spare below 0 as 0. */
+	basic_ago(int max_conc, int max_spare);
+
+	virtual ~basic_ago();
 
 	void go(std::function<void()> func);
 	void wait();
 
+	/* Any other callable is stored straight into a task record, which a
+	 * pool thread takes from its own cache, so submitting from inside a
+	 * function normally allocates nothing. */
+	template<class F>
+	void go(F &&func)
+	{
+		submit(make_task(std::forward<F>(func)));
+	}
+
+	/* number of threads functions run on */
+	int concurrency() const;
+
+	/* concurrency() plus the spare threads */
+	int worker_slots() const;
+
+	/* index in [0, worker_slots()) of the calling thread, if it is one of
+	 * this object's threads, otherwise -1. Spare threads come after the
+	 * first concurrency(). */
+	int worker_index() const;
+
+	/* Put one around a call that may block for a while inside a function
+	 * run by this object. Until it is destroyed a spare thread runs
+	 * functions in place of the blocked one, so concurrency() threads stay
+	 * busy. The spare finishes the function it is running, if any, once
+	 * the region ends, then sleeps until it is needed again. Does nothing
+	 * on threads that are not this object's. */
+	class blocking_region
+	{
+	public:
+		explicit blocking_region(basic_ago &pool);
+		~blocking_region();
+
+	private:
+		blocking_region(const blocking_region &);
+		blocking_region &operator=(const blocking_region &);
+
+		basic_ago *pool;
+	};
+
+	typedef ago_worker_stats worker_stats;
+	typedef ago_latency latency;
+	typedef ago_stats stats;
+
+	/* Collect the counters while the pool keeps running. Each counter is
+	 * read on its own, so a snapshot is not one instant in time. */
+	stats snapshot() const;
+
+	/* Turn latency histograms on or off. Off by default; when off it
+	 * costs one well predicted branch per function. */
+	void track_latency(bool on);
+
+	/* Have each thread call hook(worker_index()) when it runs out of work,
+	 * just before it sleeps, to give back what it caches. Returns an id
+	 * for remove_idle_hook(). */
+	int add_idle_hook(std::function<void(int)> hook);
+
+	/* Once this returns the hook is not running and will not run again.
+	 * Must not be called from the hook itself. */
+	void remove_idle_hook(int id);
+
+	/* Called from a function run by this object: call func on the same
+	 * thread as soon as that function returns, so work it produced can be
+	 * flushed in one go. From any other thread func is called at once. */
+	void at_return(std::function<void()> func);
+
+	/* Run func on a thread set aside for blocking calls rather than one
+	 * of the concurrency() threads. Those threads are started as needed,
+	 * within max_spare, and exit when idle for a while. Spares for
+	 * blocking regions come first: when the budget is used up, idle
+	 * go_blocking() threads exit to make room for them. One thread is
+	 * kept for these functions even with no budget left, so they always
+	 * run. wait() waits for these functions too. */
+	template<class F>
+	void go_blocking(F &&func)
+	{
+		submit_blocking(make_task(std::forward<F>(func)));
+	}
+
+	/* Run work() like go_blocking(), then give then(result) to go(), to
+	 * carry on with the result on the concurrency() threads; then() if
+	 * work() returns void. */
+	template<class Work, class Then>
+	void go_blocking(Work work, Then then)
+	{
+		go_blocking_then(work, then, std::is_void<decltype(work())>());
+	}
+
+	/* At most max threads for go_blocking(), within max_spare, each of
+	 * which exits after keep_alive_ms without work. By default max_spare
+	 * of them and ten seconds. */
+	void blocking_limits(int max, int keep_alive_ms);
+
+	/* Keyed submission: functions sharing a key run in the order they
+	 * were submitted and never at the same time. Different keys run in
+	 * parallel. */
+	template<class Key, class F>
+	void go(const Key &key, F &&func)
+	{
+		submit_keyed(std::hash<Key>()(key), make_task(std::forward<F>(func)));
+	}
+
 private:
+	/* the threads belong to one object */
+	basic_ago(const basic_ago &);
+	basic_ago &operator=(const basic_ago &);
+
 	struct ago_impl;
+	struct worker;
 	std::shared_ptr<ago_impl> impl;
 
-	static void static_idle(ago *obj);
-	void idle(void);
+	struct task_list;
+
+	/* a queued function, followed in memory by the callable itself */
+	struct task
+	{
+		/* run the callable if asked to, then destroy it */
+		void (*invoke)(task *t, bool call);
+		task *next;
+		worker *owner;		/* cache the block returns to, if any */
+		std::uint64_t queued_ns;
+		std::uint64_t trace_id;
+	};
+
+	template<class F>
+	struct task_of : task
+	{
+		template<class G>
+		explicit task_of(G &&g) : func(std::forward<G>(g)) {}
+
+		static void invoke_func(task *t, bool call)
+		{
+			task_of *self = static_cast<task_of*>(t);
+			if(call) self->func();
+			self->~task_of();
+		}
+
+		F func;
+	};
+
+	/* memory for a task record of the given size */
+	void *alloc_task(std::size_t size, worker *&owner);
+
+	template<class F>
+	task *make_task(F &&func)
+	{
+		typedef task_of<typename std::decay<F>::type> record;
+		worker *owner;
+		record *t = new(alloc_task(sizeof(record), owner)) record(std::forward<F>(func));
+		t->invoke = &record::invoke_func;
+		t->owner = owner;
+		return t;
+	}
+
+	void submit(task *t);
+	void submit_keyed(std::size_t hash, task *t);
+
+	template<class Work, class Then>
+	void go_blocking_then(Work work, Then then, std::false_type)
+	{
+		go_blocking([this, work, then]() mutable { go(std::bind(then, work())); });
+	}
+
+	template<class Work, class Then>
+	void go_blocking_then(Work work, Then then, std::true_type)
+	{
+		go_blocking([this, work, then]() mutable { work(); go(then); });
+	}
+
+	void submit_blocking(task *t);
+	void blocking_thread();
+
+	void enter_blocking();
+	void leave_blocking();
+	void balance();
+
+	static void static_idle(basic_ago *obj, int index);
+	void idle(int index);
 };
 
+typedef basic_ago<ago_fifo_queue<>, ago_park_wait, ago_task_storage<>, ago_full_stats> ago;
+
+#ifdef AGO_HEADER_ONLY
+#include "ago_impl.h"
+#else
+/* compiled once, in the library */
+extern template class basic_ago<ago_fifo_queue<>, ago_park_wait, ago_task_storage<>,
+	ago_full_stats>;
+#endif
+
 #endif	/* AGO_H */
@@ -0,0 +1,147 @@
+#ifndef AGO_ACTOR_H
+#define AGO_ACTOR_H
+
+/* Actors scheduled on an ago pool.
+ *
+ * Derive from ago_actor<Message> and implement receive(). send() may be
+ * called from any thread. The mailbox is an intrusive multi-producer
+ * single-consumer queue (Dmitry Vyukov's design), so sending never takes
+ * a lock. An actor with messages waiting is given to ago::go() once; the
+ * activation handles up to Batch messages and then gives the thread back,
+ * rescheduling itself if more arrived.
+ *
+ * An idle actor holds only the pool pointer, the queue ends, a stub node
+ * and the scheduled flag: about 48 bytes on 64 bit systems, including the
+ * vtable pointer.
+ *
+ * The owner must make sure nothing is sent to an actor, and that it is not
+ * scheduled, when it is destroyed. ago::wait() after the last send does
+ * this.
+ *
+ * On a basic_ago with other policies, give its type as Pool.
+ */
+
+#include <atomic>
+#include <utility>
+#include <cstddef>
+
+#include "ago.h"
+
+template<class Message, std::size_t Batch = 16, class Pool = ago>
+class ago_actor
+{
+public:
+	explicit ago_actor(Pool &pool)
+		: pool(&pool), head(&stub), tail(&stub), scheduled(false)
+	{
+		stub.next.store(nullptr, std::memory_order_relaxed);
+	}
+
+	virtual ~ago_actor()
+	{
+		/* free any messages that were never received */
+		while(node_base *n = pop())
+		{
+			delete static_cast<node*>(n);
+		}
+	}
+
+	/* queue msg and schedule the actor if it is not already */
+	void send(Message msg)
+	{
+		push(new node(std::move(msg)));
+		schedule();
+	}
+
+protected:
+	/* called for each message, never concurrently for one actor */
+	virtual void receive(Message &msg) = 0;
+
+private:
+	ago_actor(const ago_actor &);
+	ago_actor &operator=(const ago_actor &);
+
+	struct node_base
+	{
+		std::atomic<node_base*> next;
+	};
+
+	struct node : node_base
+	{
+		explicit node(Message &&m) : msg(std::move(m)) {}
+		Message msg;
+	};
+
+	Pool *pool;
+	std::atomic<node_base*> head;	/* producers push here */
+	std::atomic<node_base*> tail;	/* consumer pops here */
+	node_base stub;
+	std::atomic<bool> scheduled;
+
+	void push(node_base *n)
+	{
+		n->next.store(nullptr, std::memory_order_relaxed);
+		node_base *prev = head.exchange(n, std::memory_order_acq_rel);
+		prev->next.store(n, std::memory_order_release);
+	}
+
+	/* Returns nullptr when empty, or when a producer is half way through
+	 * push(). That producer will call schedule() afterwards. */
+	node_base *pop()
+	{
+		node_base *t = tail.load(std::memory_order_relaxed);
+		node_base *next = t->next.load(std::memory_order_acquire);
+		if(t == &stub)
+		{
+			if(!next) return nullptr;
+			tail.store(next, std::memory_order_relaxed);
+			t = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if(next)
+		{
+			tail.store(next, std::memory_order_relaxed);
+			return t;
+		}
+		if(t != head.load(std::memory_order_acquire)) return nullptr;
+		push(&stub);
+		next = t->next.load(std::memory_order_acquire);
+		if(next)
+		{
+			tail.store(next, std::memory_order_relaxed);
+			return t;
+		}
+		return nullptr;
+	}
+
+	void schedule()
+	{
+		if(!scheduled.exchange(true))
+		{
+			pool->go([this]{ run(); });
+		}
+	}
+
+	void run()
+	{
+		for(std::size_t i = 0; i < Batch; ++i)
+		{
+			node_base *n = pop();
+			if(!n) break;
+			receive(static_cast<node*>(n)->msg);
+			delete static_cast<node*>(n);
+		}
+
+		/* Clear the flag, then look again: a producer that saw it still
+		 * set before we cleared it relies on us to notice its message.
+		 * tail is atomic only because a new activation may already be
+		 * running by the time we read it here. */
+		scheduled.store(false);
+		if(tail.load(std::memory_order_relaxed) != &stub || head.load() != &stub)
+		{
+			schedule();
+		}
+	}
+};
+
+#endif	/* AGO_ACTOR_H */
@@ -0,0 +1,327 @@
+#ifndef AGO_ALGORITHM_H
+#define AGO_ALGORITHM_H
+
+/* Parallel algorithms run on an ago pool.
+ *
+ * Work is cut into a few chunks per pool thread and given to ago::go().
+ * The calling thread runs the first chunk itself and then blocks until
+ * the rest are done, so these must not be called from inside a function
+ * running on the same pool: with every thread waiting like that, nothing
+ * would be left to run the chunks.
+ *
+ * The pool may be any basic_ago, whatever its policies.
+ */
+
+#include <algorithm>
+#include <numeric>
+#include <functional>
+#include <iterator>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+#include "ago.h"
+
+namespace ago_detail
+{
+	/* ranges shorter than this are handled serially */
+	const std::size_t serial_cutoff = 1 << 14;
+
+	class latch
+	{
+	public:
+		explicit latch(std::size_t count) : count(count) {}
+
+		void count_down()
+		{
+			std::lock_guard<std::mutex> lock(m);
+			if(--count == 0) done.notify_all();
+		}
+
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(m);
+			done.wait(lock, [&]{ return count == 0; });
+		}
+
+	private:
+		std::size_t count;
+		std::mutex m;
+		std::condition_variable done;
+	};
+
+	/* call f(i) for every i in [0, n) on pool, and wait for them */
+	template<class Pool, class F>
+	void run_chunks(Pool &pool, std::size_t n, F &f)
+	{
+		if(n == 0) return;
+
+		latch done(n - 1);
+		for(std::size_t i = 1; i < n; ++i)
+		{
+			pool.go([&f, &done, i]{ f(i); done.count_down(); });
+		}
+		f(0);
+		done.wait();
+	}
+
+	/* number of chunks to cut n elements into */
+	template<class Pool>
+	std::size_t chunk_count(Pool &pool, std::size_t n, std::size_t per_thread)
+	{
+		std::size_t chunks = (std::size_t)std::max(pool.concurrency(), 1) * per_thread;
+		std::size_t most = (n + serial_cutoff - 1) / serial_cutoff;
+		return std::max<std::size_t>(1, std::min(chunks, most));
+	}
+
+	/* Number of elements of a that come before output position t when a
+	 * and b are merged stably, found by binary search along the merge
+	 * path. Elements of a win ties, as with std::merge. */
+	template<class It, class Compare>
+	std::size_t co_rank(std::size_t t, It a, std::size_t m, It b, std::size_t n, Compare comp)
+	{
+		std::size_t i = std::min(t, m);
+		std::size_t j = t - i;
+		std::size_t i_low = t > n ? t - n : 0;
+		std::size_t j_low = t > m ? t - m : 0;
+
+		while(1){
+			if(i > 0 && j < n && comp(b[j], a[i - 1]))
+			{
+				std::size_t delta = (i - i_low + 1) / 2;
+				j_low = j;
+				i -= delta;
+				j += delta;
+			}
+			else if(j > 0 && i < m && !comp(b[j - 1], a[i]))
+			{
+				std::size_t delta = (j - j_low + 1) / 2;
+				i_low = i;
+				i += delta;
+				j -= delta;
+			}
+			else
+			{
+				return i;
+			}
+		}
+	}
+}
+
+/* call f(i) for every i in [first, last) */
+template<class Pool, class Index, class F>
+void ago_parallel_for(Pool &pool, Index first, Index last, F f)
+{
+	if(!(first < last)) return;
+
+	std::size_t n = (std::size_t)(last - first);
+	std::size_t chunks = ago_detail::chunk_count(pool, n, 4);
+	auto body = [&](std::size_t c)
+	{
+		Index from = first + (Index)(n * c / chunks);
+		Index to = first + (Index)(n * (c + 1) / chunks);
+		for(Index i = from; i < to; ++i)
+		{
+			f(i);
+		}
+	};
+	ago_detail::run_chunks(pool, chunks, body);
+}
+
+/* Sort [first, last). Each thread sorts a chunk with std::sort, then the
+ * chunks are merged pairwise; every pairwise merge is itself split along
+ * the merge path so all threads keep working until the last round.
+ * Uses a temporary buffer of last - first default constructed values. */
+template<class Pool, class RandomIt, class Compare>
+void ago_parallel_sort(Pool &pool, RandomIt first, RandomIt last, Compare comp)
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+	std::size_t n = (std::size_t)(last - first);
+	std::size_t chunks = ago_detail::chunk_count(pool, n, 1);
+	if(chunks < 2)
+	{
+		std::sort(first, last, comp);
+		return;
+	}
+
+	/* sort the chunks */
+	std::vector<std::size_t> bounds;
+	for(std::size_t c = 0; c <= chunks; ++c)
+	{
+		bounds.push_back(n * c / chunks);
+	}
+	auto sort_chunk = [&](std::size_t c)
+	{
+		std::sort(first + bounds[c], first + bounds[c + 1], comp);
+	};
+	ago_detail::run_chunks(pool, chunks, sort_chunk);
+
+	/* merge neighbouring runs back and forth between the range and buf */
+	std::vector<value_type> buf(n);
+	bool in_buf = false;
+
+	while(bounds.size() > 2)
+	{
+		struct piece
+		{
+			std::size_t a, m, b, n, out;
+		};
+		std::vector<piece> pieces;
+		std::vector<std::size_t> merged;
+
+		for(std::size_t r = 0; r + 1 < bounds.size(); r += 2)
+		{
+			/* a lone last run is merged with nothing, which moves it */
+			std::size_t a = bounds[r];
+			std::size_t b = bounds[r + 1];
+			std::size_t end = r + 2 < bounds.size() ? bounds[r + 2] : b;
+			std::size_t m = b - a, len = end - b;
+			merged.push_back(a);
+
+			std::size_t parts = std::max<std::size_t>(1, chunks * (m + len) / n);
+			std::size_t prev_i = 0, prev_t = 0;
+			for(std::size_t p = 1; p <= parts; ++p)
+			{
+				std::size_t t = (m + len) * p / parts;
+				std::size_t i = p == parts ? m :
+					in_buf ? ago_detail::co_rank(t, buf.begin() + a, m, buf.begin() + b, len, comp)
+					       : ago_detail::co_rank(t, first + a, m, first + b, len, comp);
+				piece pc = { a + prev_i, i - prev_i, b + (prev_t - prev_i), (t - i) - (prev_t - prev_i), a + prev_t };
+				pieces.push_back(pc);
+				prev_i = i;
+				prev_t = t;
+			}
+		}
+		merged.push_back(n);
+
+		auto merge_piece = [&](std::size_t p)
+		{
+			const piece &pc = pieces[p];
+			if(in_buf)
+			{
+				std::merge(std::make_move_iterator(buf.begin() + pc.a),
+					std::make_move_iterator(buf.begin() + pc.a + pc.m),
+					std::make_move_iterator(buf.begin() + pc.b),
+					std::make_move_iterator(buf.begin() + pc.b + pc.n),
+					first + pc.out, comp);
+			}
+			else
+			{
+				std::merge(std::make_move_iterator(first + pc.a),
+					std::make_move_iterator(first + pc.a + pc.m),
+					std::make_move_iterator(first + pc.b),
+					std::make_move_iterator(first + pc.b + pc.n),
+					buf.begin() + pc.out, comp);
+			}
+		};
+		ago_detail::run_chunks(pool, pieces.size(), merge_piece);
+
+		bounds.swap(merged);
+		in_buf = !in_buf;
+	}
+
+	if(in_buf)
+	{
+		auto move_back = [&](std::size_t c)
+		{
+			std::move(buf.begin() + n * c / chunks, buf.begin() + n * (c + 1) / chunks,
+				first + n * c / chunks);
+		};
+		ago_detail::run_chunks(pool, chunks, move_back);
+	}
+}
+
+template<class Pool, class RandomIt>
+void ago_parallel_sort(Pool &pool, RandomIt first, RandomIt last)
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+	ago_parallel_sort(pool, first, last, std::less<value_type>());
+}
+
+namespace ago_detail
+{
+	/* Two pass blocked scan. The first pass reduces each block but the
+	 * last, the block totals are scanned serially, and the second pass
+	 * scans every block starting from its total. d_first may be first. */
+	template<class RandomIt, class OutIt, class T, class Pool, class BinaryOp>
+	void scan(Pool &pool, RandomIt first, RandomIt last, OutIt d_first,
+		bool inclusive, const T *init, BinaryOp op)
+	{
+		std::size_t n = (std::size_t)(last - first);
+		if(n == 0) return;
+
+		std::size_t chunks = chunk_count(pool, n, 1);
+		std::vector<T> sums(chunks);
+
+		auto reduce = [&](std::size_t c)
+		{
+			RandomIt from = first + n * c / chunks, to = first + n * (c + 1) / chunks;
+			T sum = *from;
+			for(++from; from != to; ++from)
+			{
+				sum = op(sum, *from);
+			}
+			sums[c] = sum;
+		};
+		if(chunks > 1) run_chunks(pool, chunks - 1, reduce);
+
+		/* offsets[c] is what block c continues from */
+		std::vector<T> offsets(chunks);
+		bool have_offset = init != nullptr;
+		if(have_offset) offsets[0] = *init;
+		for(std::size_t c = 1; c < chunks; ++c)
+		{
+			offsets[c] = have_offset ? op(offsets[c - 1], sums[c - 1]) : sums[c - 1];
+			have_offset = true;
+		}
+
+		auto sweep = [&](std::size_t c)
+		{
+			RandomIt from = first + n * c / chunks, to = first + n * (c + 1) / chunks;
+			OutIt out = d_first + n * c / chunks;
+			bool started = c > 0 || init != nullptr;
+			T running = offsets[c];
+			for(; from != to; ++from, ++out)
+			{
+				T value = *from;
+				if(!inclusive) *out = running;
+				running = started ? op(running, value) : value;
+				started = true;
+				if(inclusive) *out = running;
+			}
+		};
+		run_chunks(pool, chunks, sweep);
+	}
+}
+
+/* d_first[i] = first[0] op ... op first[i] */
+template<class Pool, class RandomIt, class OutIt, class BinaryOp>
+void ago_inclusive_scan(Pool &pool, RandomIt first, RandomIt last, OutIt d_first, BinaryOp op)
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+	ago_detail::scan<RandomIt, OutIt, value_type>(pool, first, last, d_first, true, nullptr, op);
+}
+
+template<class Pool, class RandomIt, class OutIt>
+void ago_inclusive_scan(Pool &pool, RandomIt first, RandomIt last, OutIt d_first)
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+	ago_inclusive_scan(pool, first, last, d_first, std::plus<value_type>());
+}
+
+/* d_first[i] = init op first[0] op ... op first[i - 1] */
+template<class Pool, class RandomIt, class OutIt, class T, class BinaryOp>
+void ago_exclusive_scan(Pool &pool, RandomIt first, RandomIt last, OutIt d_first, T init, BinaryOp op)
+{
+	ago_detail::scan<RandomIt, OutIt, T>(pool, first, last, d_first, false, &init, op);
+}
+
+template<class Pool, class RandomIt, class OutIt, class T>
+void ago_exclusive_scan(Pool &pool, RandomIt first, RandomIt last, OutIt d_first, T init)
+{
+	ago_exclusive_scan(pool, first, last, d_first, init, std::plus<T>());
+}
+
+#endif	/* AGO_ALGORITHM_H */
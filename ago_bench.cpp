@@ -0,0 +1,652 @@
+/* COMPILE: "cmake ." then "make ago_bench".
+ * RUN: ago_bench [-t threads] [-s seed] [-n scale]
+ */
+
+/* benchmarks of the lightweight thread implementation in ago */
+
+/** Each benchmark prints one line: its name, operations per second and,
+ * where it measures latency, the 50th, 99th and 99.9th percentile in
+ * microseconds. Submission throughput and latency are also measured for
+ * std::async and for a std::thread per function, as baselines.
+ * -s fixes the seed of the only random choice (the long/short mix), so
+ * runs are repeatable. -n scales the amount of work.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <random>
+#include <mutex>
+#include <unordered_map>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "ago.h"
+#include "ago_impl.h"
+#include "ago_algorithm.h"
+#ifndef _WIN32
+#include "ago_io.h"
+#endif
+#ifdef __linux__
+#include "ago_process.h"
+#endif
+#include "ago_hash_map.h"
+#include "ago_object_pool.h"
+#include "ago_remote.h"
+#include "ago_sync.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start)
+{
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static std::int64_t ns_since(bench_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		bench_clock::now() - start).count();
+}
+
+static void report(const std::string &name, double ops, double secs)
+{
+	std::cout << std::left << std::setw(36) << name << std::right
+		<< std::setw(14) << std::fixed << std::setprecision(0) << ops / secs
+		<< " ops/s" << std::endl;
+}
+
+static void report(const std::string &name, double ops, double secs,
+	std::vector<std::int64_t> &latencies_ns)
+{
+	std::sort(latencies_ns.begin(), latencies_ns.end());
+	auto at = [&](double q) -> double
+	{
+		if(latencies_ns.empty()) return 0;
+		std::size_t i = (std::size_t)(q * (latencies_ns.size() - 1));
+		return latencies_ns[i] / 1000.0;
+	};
+
+	std::cout << std::left << std::setw(36) << name << std::right
+		<< std::setw(14) << std::fixed << std::setprecision(0) << ops / secs
+		<< " ops/s" << std::setprecision(2)
+		<< "  p50 " << std::setw(9) << at(0.5)
+		<< "  p99 " << std::setw(9) << at(0.99)
+		<< "  p999 " << std::setw(9) << at(0.999) << " us" << std::endl;
+}
+
+/* empty functions submitted from several threads at once */
+static void submit_throughput(int threads, int producers, int count)
+{
+	ago r(threads);
+	auto start = bench_clock::now();
+
+	std::vector<std::thread> submitters;
+	for(int p = 0; p < producers; ++p)
+	{
+		submitters.push_back(std::thread([&]{
+			for(int i = 0; i < count / producers; ++i)
+			{
+				r.go([]{});
+			}
+		}));
+	}
+	for(auto t = submitters.begin(); t != submitters.end(); ++t)
+	{
+		t->join();
+	}
+	r.wait();
+
+	report("submit, " + std::to_string(producers) + " producer(s)",
+		count / producers * producers, seconds_since(start));
+}
+
+/* time from submission until the function starts, one at a time so it
+ * is not queueing that is measured */
+static void submit_latency(int threads, int count)
+{
+	ago r(threads);
+	std::vector<std::int64_t> latencies(count);
+
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		auto submitted = bench_clock::now();
+		std::int64_t *out = &latencies[i];
+		r.go([=]{ *out = ns_since(submitted); });
+		r.wait();
+	}
+
+	report("submit to start", count, seconds_since(start), latencies);
+}
+
+static void async_baseline(int count)
+{
+	std::vector<std::int64_t> latencies(count);
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		auto submitted = bench_clock::now();
+		std::int64_t *out = &latencies[i];
+		std::async(std::launch::async, [=]{ *out = ns_since(submitted); }).wait();
+	}
+	report("  baseline: std::async", count, seconds_since(start), latencies);
+}
+
+static void thread_baseline(int count)
+{
+	std::vector<std::int64_t> latencies(count);
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		auto submitted = bench_clock::now();
+		std::int64_t *out = &latencies[i];
+		std::thread([=]{ *out = ns_since(submitted); }).join();
+	}
+	report("  baseline: thread per function", count, seconds_since(start), latencies);
+}
+
+/* cost of ago::wait() when there is one function to wait for */
+static void wait_round_trip(int threads, int count)
+{
+	ago r(threads);
+	std::vector<std::int64_t> latencies(count);
+
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		auto begin = bench_clock::now();
+		r.go([]{});
+		r.wait();
+		latencies[i] = ns_since(begin);
+	}
+
+	report("go + wait round trip", count, seconds_since(start), latencies);
+}
+
+/* Fork without join: every call spawns its two children and the leaves
+ * add to the total, so the function count is that of recursive fib. */
+static void fib(ago &r, std::atomic<std::uint64_t> &total, int n)
+{
+	if(n < 2)
+	{
+		total.fetch_add(n, std::memory_order_relaxed);
+		return;
+	}
+	r.go([&r, &total, n]{ fib(r, total, n - 1); });
+	r.go([&r, &total, n]{ fib(r, total, n - 2); });
+}
+
+static void fork_join(int threads, int n)
+{
+	ago r(threads);
+	std::atomic<std::uint64_t> total(0);
+
+	auto start = bench_clock::now();
+	r.go([&]{ fib(r, total, n); });
+	r.wait();
+	double secs = seconds_since(start);
+
+	/* calls made by fib(n) */
+	std::uint64_t a = 1, b = 1;
+	for(int i = 1; i < n; ++i)
+	{
+		std::uint64_t c = a + b + 1;
+		a = b;
+		b = c;
+	}
+	report("fib(" + std::to_string(n) + ") = " + std::to_string(total.load()) + ", functions",
+		(double)b, secs);
+}
+
+/* Requests handled in four small stages, each submitting the next, the
+ * way a follow up function is usually started at the end of one. */
+static void stage(ago &r, std::vector<std::uint64_t> &state, int request, int step)
+{
+	state[request] = state[request] * 31 + step;
+	if(step < 3) r.go([&r, &state, request, step]{ stage(r, state, request, step + 1); });
+}
+
+static void chained_stages(int threads, int count)
+{
+	ago r(threads);
+	std::vector<std::uint64_t> state(count, 1);
+
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		r.go([&r, &state, i]{ stage(r, state, i, 0); });
+	}
+	r.wait();
+	report("4 chained stages, requests", count, seconds_since(start));
+}
+
+/* empty functions submitted from inside the pool, with ago's policies
+ * and then with statistics compiled out */
+template<class Pool>
+static void policy_submit(const std::string &name, int threads, int count)
+{
+	Pool r(threads);
+	auto start = bench_clock::now();
+	r.go([&r, count]{
+		for(int i = 0; i < count; ++i)
+		{
+			r.go([]{});
+		}
+	});
+	r.wait();
+	report(name, count, seconds_since(start));
+}
+
+static void parallel_for(int threads, std::size_t n)
+{
+	ago r(threads);
+	std::vector<double> data(n, 1.0);
+
+	auto start = bench_clock::now();
+	ago_parallel_for(r, (std::size_t)0, n, [&](std::size_t i){ data[i] = data[i] * 1.5 + 2.0; });
+	report("parallel_for elements", (double)n, seconds_since(start));
+
+	start = bench_clock::now();
+	for(std::size_t i = 0; i < n; ++i)
+	{
+		data[i] = data[i] * 1.5 + 2.0;
+	}
+	report("  baseline: serial loop", (double)n, seconds_since(start));
+}
+
+/* functions that each need a 64 KiB buffer, touched so the pages are
+ * really used */
+static void buffers(int threads, int count)
+{
+	const std::size_t size = 64 * 1024;
+	typedef std::vector<char> buffer;
+	ago r(threads);
+
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		r.go([=]{
+			buffer *b = new buffer(size);
+			for(std::size_t j = 0; j < size; j += 4096) (*b)[j] = (char)i;
+			delete b;
+		});
+	}
+	r.wait();
+	double plain = seconds_since(start);
+
+	{
+		ago_object_pool<buffer> objects(r, []{ return new buffer(size); });
+		start = bench_clock::now();
+		for(int i = 0; i < count; ++i)
+		{
+			r.go([=, &objects]{
+				buffer *b = objects.get();
+				for(std::size_t j = 0; j < size; j += 4096) (*b)[j] = (char)i;
+				objects.put(b);
+			});
+		}
+		r.wait();
+		report("64 KiB buffers from ago_object_pool", count, seconds_since(start));
+	}
+	report("  baseline: new and delete", count, plain);
+}
+
+/* lookups from every thread, one in a hundred of them a write */
+static void map_lookups(int threads, int count)
+{
+	const int keys = 100000;
+	const int per_function = 1000;
+	ago r(threads);
+
+	{
+		ago_hash_map<int, int> map(r);
+		for(int k = 0; k < keys; ++k) map.insert(k, k);
+
+		auto start = bench_clock::now();
+		for(int f = 0; f < count / per_function; ++f)
+		{
+			r.go([&map, f]{
+				std::minstd_rand rng(f);
+				for(int i = 0; i < per_function; ++i)
+				{
+					int k = (int)(rng() % keys);
+					if(i % 100 == 0) map.assign(k, i);
+					else
+					{
+						int v;
+						map.find(k, v);
+					}
+				}
+			});
+		}
+		r.wait();
+		report("lookups, ago_hash_map", count, seconds_since(start));
+	}
+
+	std::unordered_map<int, int> map;
+	std::mutex m;
+	for(int k = 0; k < keys; ++k) map[k] = k;
+
+	auto start = bench_clock::now();
+	for(int f = 0; f < count / per_function; ++f)
+	{
+		r.go([&map, &m, f]{
+			std::minstd_rand rng(f);
+			for(int i = 0; i < per_function; ++i)
+			{
+				int k = (int)(rng() % keys);
+				std::lock_guard<std::mutex> lock(m);
+				if(i % 100 == 0) map[k] = i;
+				else map.find(k);
+			}
+		});
+	}
+	r.wait();
+	report("  baseline: unordered_map and mutex", count, seconds_since(start));
+}
+
+#ifndef _WIN32
+/* Functions that each read 16 random 4 KiB blocks of a file and do a
+ * little work on them. With ago_io no thread waits in pread(), and each
+ * function's reads are submitted together. */
+static void file_reads(int threads, int count)
+{
+	const std::size_t block = 4096;
+	const std::size_t blocks = 4096;
+	const int per_function = 16;
+	char path[] = "/tmp/ago_bench_XXXXXX";
+	int fd = mkstemp(path);
+	if(fd < 0) return;
+	unlink(path);
+	std::vector<char> chunk(block * 64, 1);
+	for(std::size_t i = 0; i < blocks / 64; ++i)
+	{
+		if(::write(fd, chunk.data(), chunk.size()) != (ssize_t)chunk.size()) return;
+	}
+
+	ago r(threads);
+	std::vector<char> buffers(block * per_function * threads * 4);
+	std::atomic<std::uint64_t> total(0);
+	auto buffer = [&](int i, int j){
+		return &buffers[((i % (threads * 4)) * per_function + j) * block];
+	};
+	auto offset = [&](int i, int j){
+		return (std::int64_t)((i * per_function + j) * 2654435761u % blocks * block);
+	};
+
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		r.go([=, &total]{
+			for(int j = 0; j < per_function; ++j)
+			{
+				char *buf = buffer(i, j);
+				long n = (long)pread(fd, buf, block, (off_t)offset(i, j));
+				total.fetch_add(n > 0 ? buf[0] : 0, std::memory_order_relaxed);
+			}
+		});
+	}
+	r.wait();
+	double plain = seconds_since(start);
+
+	{
+		ago_io io(r);
+		start = bench_clock::now();
+		for(int i = 0; i < count; ++i)
+		{
+			r.go([=, &io, &total]{
+				for(int j = 0; j < per_function; ++j)
+				{
+					char *buf = buffer(i, j);
+					io.read(fd, buf, block, offset(i, j), [=, &total](long n){
+						total.fetch_add(n > 0 ? buf[0] : 0, std::memory_order_relaxed);
+					});
+				}
+			});
+		}
+		r.wait();
+		report(std::string("4 KiB reads, ago_io ") + (io.uring() ? "(io_uring)" : "(threads)"),
+			(double)count * per_function, seconds_since(start));
+	}
+	report("  baseline: pread in the function", (double)count * per_function, plain);
+	close(fd);
+}
+#endif
+
+#ifdef __linux__
+static std::string checksum(const std::string &arg)
+{
+	std::uint64_t h = 14695981039346656037ull;
+	for(auto c = arg.begin(); c != arg.end(); ++c)
+	{
+		h = (h ^ (unsigned char)*c) * 1099511628211ull;
+	}
+	return std::string((const char*)&h, sizeof(h));
+}
+
+/* calls of a small function in child processes, all in flight at once */
+static void process_calls(int threads, int count)
+{
+	ago r(threads);
+	std::atomic<int> ok(0);
+	const std::string arg(256, 'a');
+	{
+		std::vector<ago_process_pool::func> funcs(1, checksum);
+		ago_process_pool processes(r, funcs, threads);
+
+		auto start = bench_clock::now();
+		for(int i = 0; i < count; ++i)
+		{
+			processes.call(0, arg, [&ok](bool done, std::string){ if(done) ++ok; });
+		}
+		while(ok.load() < count) std::this_thread::yield();
+		report("process pool calls, 256 bytes", count, seconds_since(start));
+	}
+
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		r.go([&arg]{ checksum(arg); });
+	}
+	r.wait();
+	report("  baseline: in the pool", count, seconds_since(start));
+}
+#endif
+
+#ifndef _WIN32
+/* Calls to a node in the same process over TCP on localhost, made 64 at
+ * a time by pool functions so each function's calls share a frame, then
+ * one at a time from outside the pool, waiting for each. */
+static void remote_calls(int threads, int count)
+{
+	const int per_function = 64;
+	ago client_pool(threads);
+	ago server_pool(threads);
+	ago_tcp_listener listener(0);
+	if(listener.port() < 0) return;
+
+	ago_remote client(client_pool);
+	ago_remote server(server_pool);
+	server.handle("echo", [](const std::string &arg){ return arg; });
+	std::shared_ptr<ago_transport> outgoing = ago_tcp_transport::connect("127.0.0.1", listener.port());
+	if(!outgoing) return;
+	server.connect(listener.accept());
+	client.connect(outgoing);
+
+	std::atomic<int> answered(0);
+	const std::string arg(64, 'a');
+	auto start = bench_clock::now();
+	for(int i = 0; i < count / per_function; ++i)
+	{
+		client_pool.go([&]{
+			for(int j = 0; j < per_function; ++j)
+			{
+				client.call("echo", arg, [&answered](bool, std::string){ ++answered; });
+			}
+		});
+	}
+	while(answered.load() < count / per_function * per_function) std::this_thread::yield();
+	report("remote calls over TCP, batched", count, seconds_since(start));
+
+	int round_trips = count / 100;
+	start = bench_clock::now();
+	for(int i = 0; i < round_trips; ++i)
+	{
+		client.call("echo", arg).get();
+	}
+	report("  one at a time, round trips", round_trips, seconds_since(start));
+	client_pool.wait();
+}
+#endif
+
+static void spin_for(std::int64_t ns)
+{
+	auto start = bench_clock::now();
+	while(ns_since(start) < ns) {}
+}
+
+/* Queue wait of short functions submitted among long ones. The mix is
+ * random but repeatable from the seed. */
+static void fairness(int threads, int count, unsigned seed)
+{
+	ago r(threads);
+	std::mt19937 rng(seed);
+	std::vector<std::int64_t> latencies;
+	latencies.reserve(count);
+
+	/* -1 marks the long ones */
+	std::vector<std::int64_t> storage(count, -1);
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		auto submitted = bench_clock::now();
+		if(rng() % 10 == 0)
+		{
+			r.go([]{ spin_for(200000); });
+		}
+		else
+		{
+			std::int64_t *out = &storage[i];
+			r.go([=]{ *out = ns_since(submitted); spin_for(2000); });
+		}
+	}
+	r.wait();
+	double secs = seconds_since(start);
+
+	for(auto s = storage.begin(); s != storage.end(); ++s)
+	{
+		if(*s >= 0) latencies.push_back(*s);
+	}
+	report("short among long, short wait", count, secs, latencies);
+}
+
+/* Functions that each work for 20 us, 5 of them holding one lock, so the
+ * lock is the bottleneck once there are four threads or more. */
+static void locked_sections(int threads, int count)
+{
+	const std::int64_t outside_ns = 15000;
+	const std::int64_t inside_ns = 5000;
+
+	{
+		ago r(threads);
+		std::mutex m;
+		auto start = bench_clock::now();
+		for(int i = 0; i < count; ++i)
+		{
+			r.go([&m]{
+				spin_for(outside_ns);
+				std::lock_guard<std::mutex> lock(m);
+				spin_for(inside_ns);
+			});
+		}
+		r.wait();
+		report("locked sections, std::mutex", count, seconds_since(start));
+	}
+
+	{
+		ago r(threads);
+		ago_sync_mutex m(r);
+		auto start = bench_clock::now();
+		for(int i = 0; i < count; ++i)
+		{
+			r.go([&m]{
+				spin_for(outside_ns);
+				std::lock_guard<ago_sync_mutex> lock(m);
+				spin_for(inside_ns);
+			});
+		}
+		r.wait();
+		report("  ago_sync_mutex", count, seconds_since(start));
+	}
+
+	ago r(threads);
+	ago_sync_mutex m(r);
+	auto start = bench_clock::now();
+	for(int i = 0; i < count; ++i)
+	{
+		r.go([&m]{
+			spin_for(outside_ns);
+			m.go_locked([]{ spin_for(inside_ns); });
+		});
+	}
+	r.wait();
+	report("  ago_sync_mutex::go_locked", count, seconds_since(start));
+}
+
+int main(int argc, char **argv)
+{
+	int threads = (int)std::max(1u, std::thread::hardware_concurrency());
+	unsigned seed = 1;
+	int scale = 1;
+
+	for(int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string opt = argv[i];
+		if(opt == "-t") threads = std::atoi(argv[i + 1]);
+		else if(opt == "-s") seed = (unsigned)std::strtoul(argv[i + 1], nullptr, 10);
+		else if(opt == "-n") scale = std::atoi(argv[i + 1]);
+	}
+
+	std::cout << "ago_bench: " << threads << " threads, seed " << seed
+		<< ", scale " << scale << std::endl;
+
+	for(int producers = 1; producers <= threads; producers *= 2)
+	{
+		submit_throughput(threads, producers, 200000 * scale);
+	}
+	submit_latency(threads, 20000 * scale);
+	async_baseline(2000 * scale);
+	thread_baseline(2000 * scale);
+	wait_round_trip(threads, 20000 * scale);
+	fork_join(threads, 20 + (scale > 1 ? 2 : 0));
+	chained_stages(threads, 200000 * scale);
+	policy_submit<ago>("submit from the pool, ago", threads, 1000000 * scale);
+	policy_submit<basic_ago<ago_fifo_queue<>, ago_park_wait, ago_task_storage<>, ago_no_stats>>(
+		"  the same, ago_no_stats", threads, 1000000 * scale);
+	parallel_for(threads, (std::size_t)10000000 * scale);
+	buffers(threads, 200000 * scale);
+	map_lookups(threads, 2000000 * scale);
+#ifndef _WIN32
+	file_reads(threads, 10000 * scale);
+#endif
+#ifdef __linux__
+	process_calls(threads, 100000 * scale);
+#endif
+#ifndef _WIN32
+	remote_calls(threads, 200000 * scale);
+#endif
+	fairness(threads, 2000 * scale, seed);
+	locked_sections(threads, 20000 * scale);
+
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef AGO_CONFIG_H
+#define AGO_CONFIG_H
+
+/* Define AGO_HEADER_ONLY before including ago.h to use ago without the
+ * library: ago.h then brings in the definitions of the pool, ago_mutex
+ * and ago_trace, so that the compiler sees all of go() and can inline it
+ * into the caller. The rest of the library, such as ago_io and
+ * ago_remote, then has to be compiled into the program with
+ * AGO_HEADER_ONLY as well, without ago.cpp, ago_mutex.cpp and
+ * ago_trace.cpp, rather than linked: every file of a program must agree
+ * on it, since with it those definitions are inline and without it they
+ * are not, and a program holding both breaks the one definition rule. */
+
+/* marks definitions in the _impl.h headers, which a header-only build
+ * includes in every file */
+#ifdef AGO_HEADER_ONLY
+#define AGO_INLINE inline
+#else
+#define AGO_INLINE
+#endif
+
+#endif	/* AGO_CONFIG_H */
@@ -0,0 +1,153 @@
+/* dependency graphs of functions for ago */
+
+/* Every node keeps a count of predecessors that have not finished yet.
+ * ago_graph::run() resets the counts and gives the nodes with none to
+ * ago::go(). When a node finishes it decrements the count of each
+ * successor; the one that brings a count to zero launches that successor.
+ * The last ready successor is run straight away on the same thread, since
+ * it is likely to want the data its predecessor just produced, and the
+ * rest go through ago::go().
+ *
+ * A separate count of unfinished nodes tells ago_graph::wait() when the
+ * whole run is over. Graphs with cycles never finish.
+ */
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "ago_graph.h"
+
+struct ago_graph::graph_impl
+{
+	struct node_rec
+	{
+		explicit node_rec(std::function<void()> f)
+			: func(std::move(f)), predecessors(0), remaining(0) {}
+
+		std::function<void()> func;
+		std::vector<node> successors;
+		int predecessors;
+		std::atomic<int> remaining;
+	};
+
+	/* deque so nodes never move once added */
+	std::deque<node_rec> nodes;
+
+	ago *pool;
+
+	/* nodes of the current run that have not finished */
+	std::atomic<std::size_t> outstanding;
+
+	bool running;
+	std::mutex run_mutex;
+	std::condition_variable done_condition;
+
+	void launch(node n);
+	void execute(node n);
+};
+
+ago_graph::ago_graph()
+	: impl(new graph_impl)
+{
+	impl->pool = nullptr;
+	impl->outstanding = 0;
+	impl->running = false;
+}
+
+/* A graph may not be destroyed while it runs, so wait for it. */
+ago_graph::~ago_graph()
+{
+	wait();
+}
+
+ago_graph::node ago_graph::add(std::function<void()> func)
+{
+	impl->nodes.emplace_back(std::move(func));
+	return impl->nodes.size() - 1;
+}
+
+void ago_graph::precede(node before, node after)
+{
+	impl->nodes[before].successors.push_back(after);
+	++impl->nodes[after].predecessors;
+}
+
+void ago_graph::run(ago &pool)
+{
+	/* only one run at a time */
+	wait();
+
+	if(impl->nodes.empty()) return;
+
+	impl->pool = &pool;
+	impl->outstanding = impl->nodes.size();
+	for(auto n = begin(impl->nodes); n != end(impl->nodes); ++n)
+	{
+		n->remaining.store(n->predecessors, std::memory_order_relaxed);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(impl->run_mutex);
+		impl->running = true;
+	}
+
+	/* Collect the roots before launching any of them, since a launched
+	 * root may already be decrementing the counts we would be reading. */
+	std::vector<node> roots;
+	for(node i = 0; i < impl->nodes.size(); ++i)
+	{
+		if(impl->nodes[i].predecessors == 0)
+		{
+			roots.push_back(i);
+		}
+	}
+	for(auto r = begin(roots); r != end(roots); ++r)
+	{
+		impl->launch(*r);
+	}
+}
+
+void ago_graph::wait()
+{
+	std::unique_lock<std::mutex> lock(impl->run_mutex);
+	impl->done_condition.wait(lock, [&]{ return !impl->running; });
+}
+
+void ago_graph::graph_impl::launch(node n)
+{
+	pool->go([this, n]{ execute(n); });
+}
+
+void ago_graph::graph_impl::execute(node n)
+{
+	while(1){
+		node_rec &rec = nodes[n];
+		rec.func();
+
+		/* launch successors that were only waiting for us */
+		bool have_next = false;
+		node next = 0;
+		for(auto s = begin(rec.successors); s != end(rec.successors); ++s)
+		{
+			if(nodes[*s].remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				if(have_next) launch(next);
+				next = *s;
+				have_next = true;
+			}
+		}
+
+		if(outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			std::lock_guard<std::mutex> lock(run_mutex);
+			running = false;
+			done_condition.notify_all();
+		}
+
+		if(!have_next) return;
+		n = next;
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef AGO_GRAPH_H
+#define AGO_GRAPH_H
+
+#include <memory>
+#include <functional>
+#include <cstddef>
+
+#include "ago.h"
+
+/* A set of functions with dependencies between them, run on an ago pool.
+ * Each function is given to ago::go() as soon as all of its predecessors
+ * have finished, so no thread waits between stages. A graph can be run
+ * any number of times; nodes are allocated once when they are added.
+ */
+class ago_graph
+{
+public:
+	typedef std::size_t node;
+
+	ago_graph();
+	virtual ~ago_graph();
+
+	/* add a function to the graph */
+	node add(std::function<void()> func);
+
+	/* make after wait for before to finish */
+	void precede(node before, node after);
+
+	/* start running the graph on pool and return immediately */
+	void run(ago &pool);
+
+	/* wait until the current run has finished */
+	void wait();
+
+private:
+	struct graph_impl;
+	std::shared_ptr<graph_impl> impl;
+};
+
+#endif	/* AGO_GRAPH_H */
@@ -0,0 +1,356 @@
+#ifndef AGO_HASH_MAP_H
+#define AGO_HASH_MAP_H
+
+/* A hash map shared by the functions of an ago pool, for the state that
+ * would otherwise be a std::unordered_map under one mutex.
+ *
+ * Keys are spread over shards, by default four per thread of the pool,
+ * each an open addressing table of slots holding a key's hash and a
+ * pointer to its entry, with linear probing. Lookups take no lock and
+ * write nothing shared: entries are never changed once published, an
+ * update publishes a new entry in the slot, and old entries and tables
+ * are freed through an ago_reclaim, so a lookup on many threads at once
+ * scales with them. Writers lock their key's shard only, and a shard
+ * that fills up is rebuilt into a bigger table under that lock alone
+ * while the other shards carry on.
+ *
+ * A lookup sees each key as of some moment during the call. for_each()
+ * and size() are only exact while nothing writes.
+ *
+ * The map must be destroyed before the ago object, and not while in use.
+ *
+ * On a basic_ago with other policies, give its type as Pool, the last
+ * template parameter.
+ */
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "ago.h"
+#include "ago_reclaim.h"
+
+template<class Key, class T, class Hash = std::hash<Key>, class Eq = std::equal_to<Key>,
+	class Pool = ago>
+class ago_hash_map
+{
+	typedef basic_ago_reclaim<Pool> reclaim_domain;
+
+public:
+	/* shard_count is rounded up to a power of two; 0 picks four per
+	 * thread of the pool */
+	explicit ago_hash_map(Pool &pool, std::size_t shard_count = 0)
+		: reclaim(pool),
+		shard_mask(round_up(shard_count ? shard_count : 4 * (std::size_t)pool.worker_slots()) - 1),
+		shards(shard_mask + 1)
+	{
+	}
+
+	~ago_hash_map()
+	{
+		for(auto s = shards.begin(); s != shards.end(); ++s)
+		{
+			table *t = s->current.load(std::memory_order_relaxed);
+			for(std::size_t i = 0; i <= t->mask; ++i)
+			{
+				delete t->slots[i].e.load(std::memory_order_relaxed);
+			}
+			delete t;
+		}
+	}
+
+	/* copy the value of key into value, if there is one */
+	bool find(const Key &key, T &value) const
+	{
+		return visit(key, [&value](const T &v){ value = v; });
+	}
+
+	bool contains(const Key &key) const
+	{
+		return visit(key, [](const T &){});
+	}
+
+	/* call f(const T &) on the value of key, if there is one, without
+	 * copying it; f must not use the map */
+	template<class F>
+	bool visit(const Key &key, F f) const
+	{
+		std::uint64_t h = hash_of(key);
+		const shard &s = shard_of(h);
+		typename reclaim_domain::guard g(reclaim);
+		for(;;)
+		{
+			table *t = g.protect(s.current, 0);
+			bool moved = false;
+			entry *e = lookup(g, s, t, h, key, moved);
+
+			/* rebuilt meanwhile, so a write may have missed this table */
+			if(moved || s.current.load(std::memory_order_acquire) != t) continue;
+
+			if(!e) return false;
+			f(e->value);
+			return true;
+		}
+	}
+
+	/* add key unless it is there already; true if added */
+	bool insert(const Key &key, const T &value)
+	{
+		std::uint64_t h = hash_of(key);
+		shard &s = shard_of(h);
+		std::lock_guard<std::mutex> lock(s.m);
+		slot *at = place(s, h, key);
+		if(at->e.load(std::memory_order_relaxed)) return false;
+		publish(s, at, new entry(h, key, value));
+		return true;
+	}
+
+	/* add key, or replace its value */
+	void assign(const Key &key, const T &value)
+	{
+		update(key, [&value](T &v){ v = value; });
+	}
+
+	/* Give f(T &) a copy of the value of key, or T() if there is none,
+	 * and store what it leaves there. Calls on one key are serialized. */
+	template<class F>
+	void update(const Key &key, F f)
+	{
+		std::uint64_t h = hash_of(key);
+		shard &s = shard_of(h);
+		std::lock_guard<std::mutex> lock(s.m);
+		slot *at = place(s, h, key);
+		entry *old = at->e.load(std::memory_order_relaxed);
+
+		/* owned here until published, in case f throws */
+		std::unique_ptr<entry> e(old ? new entry(h, key, old->value) : new entry(h, key, T()));
+		f(e->value);
+		if(!old)
+		{
+			publish(s, at, e.release());
+			return;
+		}
+		at->e.store(e.release(), std::memory_order_release);
+		reclaim.retire(old);
+	}
+
+	/* true if key was there */
+	bool erase(const Key &key)
+	{
+		std::uint64_t h = hash_of(key);
+		shard &s = shard_of(h);
+		std::lock_guard<std::mutex> lock(s.m);
+		table *t = s.current.load(std::memory_order_relaxed);
+		for(std::size_t i = h & t->mask; ; i = (i + 1) & t->mask)
+		{
+			slot &at = t->slots[i];
+			std::uint64_t slot_hash = at.hash.load(std::memory_order_relaxed);
+			if(!slot_hash) return false;
+
+			/* a slot with a hash and no entry is a tombstone */
+			entry *e = at.e.load(std::memory_order_relaxed);
+			if(slot_hash == h && e && eq(e->key, key))
+			{
+				at.e.store(nullptr, std::memory_order_release);
+				s.count.store(s.count.load(std::memory_order_relaxed) - 1,
+					std::memory_order_relaxed);
+				++s.tombstones;
+				reclaim.retire(e);
+				return true;
+			}
+		}
+	}
+
+	std::size_t size() const
+	{
+		std::size_t n = 0;
+		for(auto s = shards.begin(); s != shards.end(); ++s)
+		{
+			n += s->count.load(std::memory_order_relaxed);
+		}
+		return n;
+	}
+
+	/* call f(const Key &, const T &) for every entry, a shard at a time
+	 * with that shard locked; f must not use the map */
+	template<class F>
+	void for_each(F f) const
+	{
+		for(auto s = shards.begin(); s != shards.end(); ++s)
+		{
+			std::lock_guard<std::mutex> lock(s->m);
+			table *t = s->current.load(std::memory_order_relaxed);
+			for(std::size_t i = 0; i <= t->mask; ++i)
+			{
+				entry *e = t->slots[i].e.load(std::memory_order_relaxed);
+				if(e) f(e->key, e->value);
+			}
+		}
+	}
+
+private:
+	ago_hash_map(const ago_hash_map &);
+	ago_hash_map &operator=(const ago_hash_map &);
+
+	static const std::size_t initial_slots = 16;
+
+	struct entry
+	{
+		entry(std::uint64_t hash, const Key &key, const T &value)
+			: hash(hash), key(key), value(value)
+		{
+		}
+
+		std::uint64_t hash;
+		Key key;
+		T value;
+	};
+
+	/* hash 0: never used, which ends a probe */
+	struct slot
+	{
+		slot() : hash(0), e(nullptr) {}
+
+		std::atomic<std::uint64_t> hash;
+		std::atomic<entry*> e;
+	};
+
+	struct table
+	{
+		explicit table(std::size_t size) : mask(size - 1), slots(new slot[size]) {}
+
+		std::size_t mask;
+		std::unique_ptr<slot[]> slots;
+	};
+
+	struct shard
+	{
+		shard() : current(new table(initial_slots)), count(0), tombstones(0) {}
+
+		/* keep neighbouring shards off each other's cache lines */
+		char pad_before[64];
+		std::atomic<table*> current;
+		std::atomic<std::size_t> count;
+		std::size_t tombstones;		/* under m */
+		mutable std::mutex m;
+		char pad_after[64];
+	};
+
+	static std::size_t round_up(std::size_t n)
+	{
+		std::size_t power = 1;
+		while(power < n) power *= 2;
+		return power;
+	}
+
+	std::uint64_t hash_of(const Key &key) const
+	{
+		/* spread the bits, since the shard comes from the top and the
+		 * slot from the bottom */
+		std::uint64_t h = (std::uint64_t)hasher(key) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+		return h ? h : 1;
+	}
+
+	shard &shard_of(std::uint64_t h) { return shards[(h >> 40) & shard_mask]; }
+	const shard &shard_of(std::uint64_t h) const { return shards[(h >> 40) & shard_mask]; }
+
+	entry *lookup(typename reclaim_domain::guard &g, const shard &s, table *t, std::uint64_t h,
+		const Key &key, bool &moved) const
+	{
+		for(std::size_t i = h & t->mask; ; i = (i + 1) & t->mask)
+		{
+			slot &at = t->slots[i];
+			std::uint64_t slot_hash = at.hash.load(std::memory_order_acquire);
+			if(!slot_hash) return nullptr;
+			if(slot_hash != h) continue;
+
+			/* A rebuilt table is never written again, so off the pool
+			 * protect() cannot tell that e was since replaced in the new
+			 * one, and maybe freed; only trust it while t is current. */
+			entry *e = g.protect(at.e, 1);
+			if(s.current.load() != t)
+			{
+				moved = true;
+				return nullptr;
+			}
+			if(e && e->hash == h && eq(e->key, key)) return e;
+		}
+	}
+
+	/* With the shard locked: the slot holding key, else the one it
+	 * should go in, growing the table first if need be. */
+	slot *place(shard &s, std::uint64_t h, const Key &key)
+	{
+		table *t = s.current.load(std::memory_order_relaxed);
+		std::size_t used = s.count.load(std::memory_order_relaxed) + s.tombstones;
+		if((used + 1) * 4 > (t->mask + 1) * 3) t = rebuild(s);
+
+		slot *tombstone = nullptr;
+		for(std::size_t i = h & t->mask; ; i = (i + 1) & t->mask)
+		{
+			slot &at = t->slots[i];
+			std::uint64_t slot_hash = at.hash.load(std::memory_order_relaxed);
+			if(!slot_hash) return tombstone ? tombstone : &at;
+
+			entry *e = at.e.load(std::memory_order_relaxed);
+			if(!e)
+			{
+				if(!tombstone) tombstone = &at;
+			}
+			else if(slot_hash == h && eq(e->key, key))
+			{
+				return &at;
+			}
+		}
+	}
+
+	/* with the shard locked: put a new entry in an empty slot or a
+	 * tombstone from place() */
+	void publish(shard &s, slot *at, entry *e)
+	{
+		if(at->hash.load(std::memory_order_relaxed)) --s.tombstones;
+		at->hash.store(e->hash, std::memory_order_release);
+		at->e.store(e, std::memory_order_release);
+		s.count.store(s.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	/* with the shard locked: copy the entries into a table with room for
+	 * twice as many, dropping tombstones; lookups still on the old one
+	 * see it changed and look again */
+	table *rebuild(shard &s)
+	{
+		table *old = s.current.load(std::memory_order_relaxed);
+		std::size_t size = initial_slots;
+		while(size < 4 * (s.count.load(std::memory_order_relaxed) + 1)) size *= 2;
+
+		table *t = new table(size);
+		for(std::size_t i = 0; i <= old->mask; ++i)
+		{
+			entry *e = old->slots[i].e.load(std::memory_order_relaxed);
+			if(!e) continue;
+
+			std::size_t j = e->hash & t->mask;
+			while(t->slots[j].hash.load(std::memory_order_relaxed)) j = (j + 1) & t->mask;
+			t->slots[j].hash.store(e->hash, std::memory_order_relaxed);
+			t->slots[j].e.store(e, std::memory_order_relaxed);
+		}
+
+		s.current.store(t, std::memory_order_release);
+		s.tombstones = 0;
+		reclaim.retire(old);
+		return t;
+	}
+
+	mutable reclaim_domain reclaim;
+	Hash hasher;
+	Eq eq;
+	std::size_t shard_mask;
+	std::vector<shard> shards;
+};
+
+#endif	/* AGO_HASH_MAP_H */
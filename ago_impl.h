@@ -0,0 +1,1390 @@
+#ifndef AGO_IMPL_H
+#define AGO_IMPL_H
+
+/* lightweight goroutine-like threads for C++ */
+/* by Andrew Gascoyne-Cecil based on C implementation by Alireza Nejati */
+
+/* This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA. 
+ */
+
+/* The members of basic_ago. The library compiles them for ago; include
+ * this header too to use basic_ago with other policies. With
+ * AGO_HEADER_ONLY ago.h includes it, and go() can be inlined whole. */
+
+/**The way this is done is we have several idle threads that don't do
+ * anything until ago::go() is called. We have a mutex protected queue that counts
+ * how many *functions* there are waiting to be called, not how many
+ * *threads* that are running idle. Each time ago::go() is called, the
+ * oldest function in the queue is run in the next available thread. */
+
+/* If all threads are currently busy, it waits until a thread becomes
+ * free */
+ 
+/* All accesses to the function queue are done in a mutex. Since they
+ * are usually just reads or writes, they return very quickly */
+
+/* We must provide a way for the main thread to wait until all functions
+ * have been executed. This is ago::wait().
+ * The mechanism behind it is condition variables.
+ */
+
+/* Each idle thread parks on its own condition variable, so ago::go()
+ * wakes exactly one thread that is asleep rather than any waiter.
+ * Keyed functions (ago::go(key, func)) are hashed onto a queue owned by a
+ * single thread and only that thread drains it, so functions with the
+ * same key run in order, never concurrently, and stay on the same core.
+ * Nothing is stored per key. */
+
+/* Each thread keeps its own statistics counters. Only the owner writes
+ * them, with plain relaxed loads and stores rather than read-modify-write
+ * operations, and they are padded away from everything else so that
+ * ago::snapshot() can read them without disturbing the owner. Busy and
+ * idle time are measured when a thread parks and wakes, not per
+ * function, so the clock is only read on the slow path. */
+
+/* Latency histograms are log-linear: each power of two is split into 16
+ * equal buckets, which bounds the error at 1/16 of the value over the
+ * whole 64 bit range with under a thousand buckets. Like the counters,
+ * each thread has its own and they are summed when read. */
+
+/* A function is queued as a task record with the callable stored right
+ * after it, and the queues link the records together, so queueing one
+ * allocates nothing itself. Records submitted from a pool thread come
+ * from fixed size blocks cached by that thread. Whichever thread runs the
+ * function gives the block back: straight into the cache if it is the
+ * owner, otherwise onto the owner's returned list, which is pushed with
+ * a compare and swap and emptied by the owner in one exchange. A thread
+ * only allocates a block when both are empty, so a steady load recycles
+ * the same blocks. Blocks are carved from slabs of several at a time, and
+ * a slab is freed once all of its blocks are. The cache is capped, and a
+ * thread about to park frees all but a few, so memory taken at a peak is
+ * given back once it passes. Threads outside the pool share one more
+ * such cache, taking from it under a mutex of its own. Only records that
+ * do not fit a block are allocated and freed individually. */
+
+/* A function submitted by a pool thread goes into that thread's next
+ * slot rather than the shared queue, displacing any function already
+ * there to the back of the queue, and the thread runs it as soon as the
+ * current one returns, while its data is still in cache. That way a
+ * chain of small functions stays on one core. Two things stop this from
+ * starving other work. After a run of next slot functions the thread
+ * takes one from the queues, if any are waiting. And a thread that finds
+ * nothing else to do takes another thread's next slot, after a short
+ * wait that lets the owner take it first if it is about to finish. */
+
+/* Spare workers follow the first max_conc in the list and have no
+ * threads until a blocking_region first needs them. With n threads in
+ * blocking regions the first n spares are enabled; leaving a region
+ * retires the last enabled spare, which stops taking functions once its
+ * current one returns and sleeps until it is enabled again. The count is
+ * what matters, not which thread blocked, so nested and overlapping
+ * regions need no bookkeeping beyond it. Spares never own keyed queues. */
+
+/* go_blocking() functions have a queue and threads of their own. The
+ * threads are not workers: they are started when a function is queued
+ * and none is idle, and exit after keep_alive without work. Enabled
+ * spares and these threads share the max_spare budget. Spares are
+ * enabled first whenever budget is free, and idle blocking threads exit
+ * at once while a spare is waiting for budget, so go_blocking() work
+ * cannot keep the concurrency() threads short for long. */
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+#include "ago.h"
+#include "ago_mutex.h"
+#include "ago_trace.h"
+
+#define AGO_TEMPLATE template<class QueuePolicy, class WaitPolicy, class TaskPolicy, \
+	class StatsPolicy>
+#define AGO_CLASS basic_ago<QueuePolicy, WaitPolicy, TaskPolicy, StatsPolicy>
+
+namespace ago_detail
+{
+	/* large enough to keep two things off each other's cache lines */
+	const std::size_t cache_line = 64;
+
+	struct counters
+	{
+		char pad_before[cache_line];
+		std::atomic<std::uint64_t> submitted;
+		std::atomic<std::uint64_t> executed;
+		std::atomic<std::uint64_t> stolen;
+		std::atomic<std::uint64_t> parked;
+		std::atomic<std::uint64_t> unparked;
+		std::atomic<std::uint64_t> busy_ns;
+		std::atomic<std::uint64_t> idle_ns;
+		char pad_after[cache_line];
+	};
+
+	/* add to a counter only ever written by the calling thread */
+	inline void bump(std::atomic<std::uint64_t> &counter, std::uint64_t n = 1)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+	}
+
+	inline std::uint64_t now_ns()
+	{
+		return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	struct histogram
+	{
+		static const int sub_bits = 4;
+		static const int sub_count = 1 << sub_bits;
+		static const int bucket_count = (64 - sub_bits + 1) * sub_count;
+
+		std::atomic<std::uint64_t> buckets[bucket_count];
+
+		histogram()
+		{
+			for(int i = 0; i < bucket_count; ++i)
+			{
+				buckets[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		static int bucket(std::uint64_t v)
+		{
+			if(v < (std::uint64_t)sub_count) return (int)v;
+			int e = 63;
+			while(!(v >> e)) --e;
+			int sub = (int)(v >> (e - sub_bits)) & (sub_count - 1);
+			return (e - sub_bits + 1) * sub_count + sub;
+		}
+
+		/* middle of the range of values that land in bucket b */
+		static std::uint64_t value(int b)
+		{
+			if(b < sub_count) return (std::uint64_t)b;
+			int e = b / sub_count + sub_bits - 1;
+			std::uint64_t low = (std::uint64_t)(sub_count + b % sub_count) << (e - sub_bits);
+			return low + ((std::uint64_t)1 << (e - sub_bits)) / 2;
+		}
+
+		/* only called by the owning thread */
+		void record(std::uint64_t v)
+		{
+			bump(buckets[bucket(v)]);
+		}
+
+		void add_to(std::vector<std::uint64_t> &sum) const
+		{
+			for(int i = 0; i < bucket_count; ++i)
+			{
+				sum[i] += buckets[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		static ago_latency percentiles(const std::vector<std::uint64_t> &sum)
+		{
+			ago_latency l = ago_latency();
+			for(int i = 0; i < bucket_count; ++i)
+			{
+				l.count += sum[i];
+			}
+			if(l.count == 0) return l;
+
+			/* smallest values with at least the given fraction at or below;
+			 * bucket 0 holds 0 ns, so 0 cannot mean not found yet */
+			std::uint64_t seen = 0;
+			bool p50 = false, p99 = false, p999 = false;
+			for(int i = 0; i < bucket_count; ++i)
+			{
+				if(!sum[i]) continue;
+				seen += sum[i];
+				if(!p50 && seen * 2 >= l.count)
+				{
+					l.p50_ns = value(i);
+					p50 = true;
+				}
+				if(!p99 && seen * 100 >= l.count * 99)
+				{
+					l.p99_ns = value(i);
+					p99 = true;
+				}
+				if(!p999 && seen * 1000 >= l.count * 999)
+				{
+					l.p999_ns = value(i);
+					p999 = true;
+				}
+				l.max_ns = value(i);
+			}
+			return l;
+		}
+	};
+
+	/* in place of a histogram when latency is not tracked */
+	struct no_histogram
+	{
+		void record(std::uint64_t) {}
+		void add_to(std::vector<std::uint64_t> &) const {}
+	};
+
+	/* next slot functions run in a row before the queues get a turn */
+	const int next_limit = 16;
+
+	/* how long a thread with nothing to do leaves another's next slot */
+	const std::uint64_t steal_delay_ns = 3000;
+
+	struct free_block
+	{
+		free_block *next;
+	};
+
+	/* Blocks come in slabs of slab_blocks, each block preceded by a
+	 * pointer to its slab, which counts the blocks not yet freed. Only
+	 * the thread owning the blocks frees them. */
+	const std::size_t slab_blocks = 16;
+	const std::size_t block_align = 16;
+
+	struct slab
+	{
+		std::size_t live;
+	};
+
+	/* a new slab's first block, with the others pushed onto rest */
+	inline void *new_slab(std::size_t block_size, free_block *&rest)
+	{
+		std::size_t stride = block_align + (block_size + block_align - 1) / block_align * block_align;
+		char *p = static_cast<char*>(::operator new(block_align + slab_blocks * stride));
+		slab *s = reinterpret_cast<slab*>(p);
+		s->live = slab_blocks;
+
+		void *first = nullptr;
+		for(std::size_t i = 0; i < slab_blocks; ++i)
+		{
+			char *at = p + block_align + i * stride;
+			*reinterpret_cast<slab**>(at) = s;
+			void *b = at + block_align;
+			if(!first)
+			{
+				first = b;
+				continue;
+			}
+			free_block *f = static_cast<free_block*>(b);
+			f->next = rest;
+			rest = f;
+		}
+		return first;
+	}
+
+	inline void free_block_memory(void *b)
+	{
+		slab *s = *reinterpret_cast<slab**>(static_cast<char*>(b) - block_align);
+		if(--s->live == 0) ::operator delete(s);
+	}
+
+	inline void free_blocks(free_block *b)
+	{
+		while(b)
+		{
+			free_block *next = b->next;
+			free_block_memory(b);
+			b = next;
+		}
+	}
+
+	inline std::uint64_t trace_submit()
+	{
+		return ago_trace::enabled() ? ago_trace::record_submit() : 0;
+	}
+
+	/* destroy every task in a queue without running it */
+	template<class Queue>
+	void discard(Queue &queue)
+	{
+		while(!queue.empty())
+		{
+			auto t = queue.pop();
+			t->invoke(t, false);
+			if(t->owner) free_block_memory(t);
+			else ::operator delete(t);
+		}
+	}
+}
+
+/* tasks in submission order, linked through task::next, for the
+ * queues that must keep it whatever QueuePolicy says */
+AGO_TEMPLATE
+struct AGO_CLASS::task_list : ago_fifo_queue<>::queue<task>
+{
+};
+
+AGO_TEMPLATE
+struct AGO_CLASS::worker
+{
+	std::thread *thread;
+
+	/* the pool this thread belongs to, and where in it */
+	ago_impl *pool;
+	int index;
+
+	ago_detail::counters stats;
+
+	typedef typename std::conditional<StatsPolicy::latency, ago_detail::histogram,
+		ago_detail::no_histogram>::type histogram;
+	histogram queue_wait;
+	histogram run;
+
+	/* keyed functions owned by this thread, in submission order */
+	task_list keyed_list;
+
+	/* set while the thread is asleep in ago::idle() */
+	bool parked;
+
+	/* set while a spare is not needed */
+	bool retired;
+
+	/* blocking_region objects alive on this thread */
+	int blocking_depth;
+
+	/* alternates between keyed and shared functions when both wait */
+	bool keyed_turn;
+
+	/* at_return() functions of the function running now */
+	std::vector<std::function<void()>> at_return;
+
+	/* the last function this thread submitted, to run next */
+	task *next;
+	int next_streak;
+
+	std::condition_variable run_condition;
+
+	/* free blocks only this thread touches */
+	ago_detail::free_block *cache;
+	std::size_t cached;
+
+	/* blocks given back by other threads */
+	char pad_before[ago_detail::cache_line];
+	std::atomic<ago_detail::free_block*> returned;
+	char pad_after[ago_detail::cache_line];
+
+	/* a block for a task record; only called by this thread */
+	void *take_block()
+	{
+		if(!cache)
+		{
+			cache = returned.exchange(nullptr, std::memory_order_acquire);
+			for(ago_detail::free_block *b = cache; b; b = b->next) ++cached;
+			trim_cache(TaskPolicy::cache_limit);
+			if(!cache)
+			{
+				cached = ago_detail::slab_blocks - 1;
+				return ago_detail::new_slab(TaskPolicy::block_size, cache);
+			}
+		}
+		ago_detail::free_block *b = cache;
+		cache = b->next;
+		--cached;
+		return b;
+	}
+
+	/* give back a block this worker handed out; by is the calling
+	 * thread's worker */
+	void give_block(void *p, worker *by)
+	{
+		ago_detail::free_block *b = static_cast<ago_detail::free_block*>(p);
+		if(by == this)
+		{
+			if(cached >= TaskPolicy::cache_limit)
+			{
+				ago_detail::free_block_memory(b);
+				return;
+			}
+			b->next = cache;
+			cache = b;
+			++cached;
+			return;
+		}
+
+		b->next = returned.load(std::memory_order_relaxed);
+		while(!returned.compare_exchange_weak(b->next, b,
+			std::memory_order_release, std::memory_order_relaxed)) {}
+	}
+
+	/* free all but keep cached blocks; only called by this thread */
+	void trim(std::size_t keep)
+	{
+		ago_detail::free_blocks(returned.exchange(nullptr, std::memory_order_acquire));
+		trim_cache(keep);
+	}
+
+	void trim_cache(std::size_t keep)
+	{
+		while(cached > keep)
+		{
+			ago_detail::free_block *b = cache;
+			cache = b->next;
+			--cached;
+			ago_detail::free_block_memory(b);
+		}
+	}
+
+	/* whether trim(keep) has anything to free */
+	bool over(std::size_t keep) const
+	{
+		return cached > keep || returned.load(std::memory_order_relaxed);
+	}
+
+	/* add to one of this thread's counters, if they are kept */
+	void count(std::atomic<std::uint64_t> &counter, std::uint64_t n = 1)
+	{
+		if(StatsPolicy::counters) ago_detail::bump(counter, n);
+	}
+
+	/* The thread is going to sleep, or has woken up; since is when it
+	 * last did the other, and becomes now. */
+	void sleeping(std::uint64_t &since)
+	{
+		if(!StatsPolicy::counters) return;
+		std::uint64_t now = ago_detail::now_ns();
+		count(stats.parked);
+		count(stats.busy_ns, now - since);
+		since = now;
+	}
+
+	void woken(std::uint64_t &since)
+	{
+		if(!StatsPolicy::counters) return;
+		std::uint64_t now = ago_detail::now_ns();
+		count(stats.unparked);
+		count(stats.idle_ns, now - since);
+		since = now;
+	}
+};
+
+AGO_TEMPLATE
+struct AGO_CLASS::ago_impl
+{
+	ago_impl() : func_mutex("ago func_mutex") {}
+
+	/* the quit message */
+	bool ago_quit;
+
+	/* one per idle thread, then the spares */
+	std::vector<worker*> workers;
+	int max_conc;
+
+	/* task blocks for threads outside the pool, taken under
+	 * outside_mutex; it runs no functions */
+	worker *outside;
+	std::mutex outside_mutex;
+
+	/* threads inside a blocking_region, and spares enabled for them */
+	int blocked;
+	int enabled_spares;
+
+	/* threads allowed beyond max_conc, spares and blocking ones */
+	int max_spare;
+
+	/* go_blocking() functions, and the threads that run them */
+	task_list blocking_list;
+	int blocking_threads;
+	int blocking_idle;
+	int max_blocking;
+	std::chrono::milliseconds keep_alive;
+	std::condition_variable blocking_condition;
+
+	/* whether blocking threads hold budget a spare is waiting for */
+	bool spares_starved() const
+	{
+		return enabled_spares < blocked &&
+			enabled_spares < (int)workers.size() - max_conc &&
+			blocking_threads > 0 && enabled_spares + blocking_threads >= max_spare;
+	}
+
+	/* indices of parked workers, most recently parked last */
+	std::vector<int> parked_list;
+
+	/* take the most recently parked worker off the list, for the caller to
+	 * notify */
+	worker *claim_parked()
+	{
+		if(parked_list.empty()) return nullptr;
+		worker *w = workers[parked_list.back()];
+		parked_list.pop_back();
+		w->parked = false;
+		return w;
+	}
+
+	/* queue of function pointers */
+	typename QueuePolicy::template queue<task> func_list;
+	ago_mutex func_mutex;
+
+	/* workers whose next slot is taken */
+	int next_count;
+
+	/* a worker other than self with a function in its next slot */
+	worker *next_victim(worker *self)
+	{
+		if(next_count == 0) return nullptr;
+		for(auto w = begin(workers); w != end(workers); ++w)
+		{
+			if(*w != self && (*w)->next) return *w;
+		}
+		return nullptr;
+	}
+
+	/* functions submitted but not yet finished */
+	std::size_t pending;
+
+	/* these help with ago::wait */
+	std::condition_variable idle_condition;
+
+	/* whether functions are being timed */
+	std::atomic<bool> track_latency;
+
+	/* an add_idle_hook() hook, and how many threads are calling it */
+	struct idle_hook
+	{
+		idle_hook(int id, std::function<void(int)> func)
+			: id(id), func(std::move(func)), busy(0), removed(false)
+		{
+		}
+
+		int id;
+		std::function<void(int)> func;
+		std::atomic<int> busy;
+		std::atomic<bool> removed;
+	};
+	typedef std::vector<std::shared_ptr<idle_hook>> hook_list;
+
+	/* Replaced, never changed, by add_idle_hook() and remove_idle_hook(),
+	 * so a parking thread takes the hooks with a reference count, not a
+	 * copy. */
+	std::shared_ptr<const hook_list> idle_hooks;
+	int next_hook_id;
+	std::condition_variable hooks_condition;
+
+	/* timestamp for a function being queued now */
+	std::uint64_t queued_ns()
+	{
+		return StatsPolicy::latency && track_latency.load(std::memory_order_relaxed) ?
+			ago_detail::now_ns() : 0;
+	}
+
+	/* submissions from threads outside the pool, and functions run by
+	 * go_blocking() threads, which have no counters of their own */
+	char pad_before[ago_detail::cache_line];
+	std::atomic<std::uint64_t> external_submitted;
+	std::atomic<std::uint64_t> blocking_executed;
+	char pad_after[ago_detail::cache_line];
+
+	/* the worker running on this thread, if any */
+	static thread_local worker *current;
+
+	/* count a submission against whoever is making it */
+	void submitted()
+	{
+		if(!StatsPolicy::counters) return;
+		if(current && current->pool == this)
+		{
+			current->count(current->stats.submitted);
+		}
+		else
+		{
+			external_submitted.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+};
+
+AGO_TEMPLATE
+thread_local typename AGO_CLASS::worker *AGO_CLASS::ago_impl::current = nullptr;
+
+AGO_TEMPLATE
+AGO_CLASS::basic_ago(int max_conc)
+	: basic_ago(max_conc, max_conc)
+{
+}
+
+/**
+ *  ago constructor
+ *	max_conc: number of concurrent threads to run.
+ *	max_spare: most threads to add while others are blocked.
+ */
+AGO_TEMPLATE
+AGO_CLASS::basic_ago(int max_conc, int max_spare)
+	: impl(new ago_impl)
+{
+	/* keyed submission picks a thread among the first max_conc */
+	if(max_conc < 1) max_conc = 1;
+	if(max_spare < 0) max_spare = 0;
+
+	impl->ago_quit = false;
+	impl->max_conc = max_conc;
+	impl->blocked = 0;
+	impl->enabled_spares = 0;
+	impl->max_spare = max_spare;
+	impl->blocking_threads = 0;
+	impl->blocking_idle = 0;
+	impl->max_blocking = max_spare;
+	impl->keep_alive = std::chrono::milliseconds(10000);
+	impl->pending = 0;
+	impl->next_count = 0;
+	impl->external_submitted = 0;
+	impl->blocking_executed = 0;
+	impl->track_latency = false;
+	impl->next_hook_id = 0;
+	impl->idle_hooks = std::make_shared<typename ago_impl::hook_list>();
+
+	/* Allocate every worker before starting any thread, since keyed
+	 * submissions may address any of them. */
+	for(int i = -1; i < max_conc + max_spare; ++i)
+	{
+		worker *w = new worker;
+		w->thread = nullptr;
+		w->pool = impl.get();
+		w->index = i;
+		w->stats.submitted = 0;
+		w->stats.executed = 0;
+		w->stats.stolen = 0;
+		w->stats.parked = 0;
+		w->stats.unparked = 0;
+		w->stats.busy_ns = 0;
+		w->stats.idle_ns = 0;
+		w->parked = false;
+		w->retired = i >= max_conc;
+		w->blocking_depth = 0;
+		w->keyed_turn = false;
+		w->next = nullptr;
+		w->next_streak = 0;
+		w->cache = nullptr;
+		w->cached = 0;
+		w->returned = nullptr;
+
+		/* the first, not a thread, holds the blocks of threads outside
+		 * the pool */
+		if(i < 0) impl->outside = w;
+		else impl->workers.push_back(w);
+	}
+
+	/* Create required number of idle threads. Spares start when first
+	 * needed. */
+	for(int i = 0; i < max_conc; ++i)
+	{
+		impl->workers[i]->thread = new std::thread(&basic_ago::static_idle, this, i);
+	}
+}
+
+/* waits until every function submitted so far, and every function those
+ * submit in turn, has finished running.
+ * Must not be called from inside a function run by this object, since
+ * that function would be waiting for itself.
+ */
+AGO_TEMPLATE
+void AGO_CLASS::wait()
+{
+	/* Atomically wait until nothing is queued or running. */
+	std::unique_lock<std::mutex> lock = impl->func_mutex.lock_native("ago::wait");
+	impl->idle_condition.wait(lock, [&]{ return impl->pending == 0; });
+}
+
+AGO_TEMPLATE
+int AGO_CLASS::concurrency() const
+{
+	return impl->max_conc;
+}
+
+AGO_TEMPLATE
+int AGO_CLASS::worker_slots() const
+{
+	return (int)impl->workers.size();
+}
+
+AGO_TEMPLATE
+int AGO_CLASS::worker_index() const
+{
+	worker *w = ago_impl::current;
+	return w && w->pool == impl.get() ? w->index : -1;
+}
+
+AGO_TEMPLATE
+ago_stats AGO_CLASS::snapshot() const
+{
+	stats result = stats();
+
+	for(auto w = begin(impl->workers); w != end(impl->workers); ++w)
+	{
+		const ago_detail::counters &c = (*w)->stats;
+		worker_stats ws;
+		ws.submitted = c.submitted.load(std::memory_order_relaxed);
+		ws.executed = c.executed.load(std::memory_order_relaxed);
+		ws.stolen = c.stolen.load(std::memory_order_relaxed);
+		ws.parked = c.parked.load(std::memory_order_relaxed);
+		ws.unparked = c.unparked.load(std::memory_order_relaxed);
+		ws.busy_ns = c.busy_ns.load(std::memory_order_relaxed);
+		ws.idle_ns = c.idle_ns.load(std::memory_order_relaxed);
+		result.workers.push_back(ws);
+
+		result.total.submitted += ws.submitted;
+		result.total.executed += ws.executed;
+		result.total.stolen += ws.stolen;
+		result.total.parked += ws.parked;
+		result.total.unparked += ws.unparked;
+		result.total.busy_ns += ws.busy_ns;
+		result.total.idle_ns += ws.idle_ns;
+	}
+
+	std::vector<std::uint64_t> queue_wait(ago_detail::histogram::bucket_count);
+	std::vector<std::uint64_t> run(ago_detail::histogram::bucket_count);
+	for(auto w = begin(impl->workers); w != end(impl->workers); ++w)
+	{
+		(*w)->queue_wait.add_to(queue_wait);
+		(*w)->run.add_to(run);
+	}
+	result.queue_wait = ago_detail::histogram::percentiles(queue_wait);
+	result.run = ago_detail::histogram::percentiles(run);
+
+	result.external_submitted = impl->external_submitted.load(std::memory_order_relaxed);
+	result.total.submitted += result.external_submitted;
+	result.blocking_executed = impl->blocking_executed.load(std::memory_order_relaxed);
+	result.total.executed += result.blocking_executed;
+
+	/* the queue lengths need the lock, but only for a moment */
+	ago_lock_guard lock(impl->func_mutex, "ago::snapshot");
+	result.queued = impl->func_list.size();
+	for(auto w = begin(impl->workers); w != end(impl->workers); ++w)
+	{
+		result.queued += (*w)->keyed_list.size();
+	}
+	result.queued += impl->next_count + impl->blocking_list.size();
+	result.blocking_threads = impl->blocking_threads;
+	result.pending = impl->pending;
+	for(auto w = begin(impl->workers); w != end(impl->workers); ++w)
+	{
+		if((*w)->thread && !(*w)->parked && !(*w)->retired) ++result.busy;
+	}
+
+	return result;
+}
+
+AGO_TEMPLATE
+void AGO_CLASS::track_latency(bool on)
+{
+	impl->track_latency.store(on, std::memory_order_relaxed);
+}
+
+AGO_TEMPLATE
+int AGO_CLASS::add_idle_hook(std::function<void(int)> hook)
+{
+	typedef typename ago_impl::idle_hook idle_hook;
+	typedef typename ago_impl::hook_list hook_list;
+
+	ago_lock_guard lock(impl->func_mutex, "ago::add_idle_hook");
+	int id = impl->next_hook_id++;
+	std::shared_ptr<hook_list> hooks = std::make_shared<hook_list>(*impl->idle_hooks);
+	hooks->push_back(std::make_shared<idle_hook>(id, std::move(hook)));
+	impl->idle_hooks = hooks;
+	return id;
+}
+
+AGO_TEMPLATE
+void AGO_CLASS::remove_idle_hook(int id)
+{
+	typedef typename ago_impl::idle_hook idle_hook;
+	typedef typename ago_impl::hook_list hook_list;
+
+	std::unique_lock<std::mutex> lock = impl->func_mutex.lock_native("ago::remove_idle_hook");
+	std::shared_ptr<hook_list> hooks = std::make_shared<hook_list>();
+	std::shared_ptr<idle_hook> removed;
+	for(auto h = impl->idle_hooks->begin(); h != impl->idle_hooks->end(); ++h)
+	{
+		if((*h)->id == id) removed = *h;
+		else hooks->push_back(*h);
+	}
+	if(!removed) return;
+	impl->idle_hooks = hooks;
+
+	/* Threads may still hold the old list. Each marks the hook busy
+	 * before looking at removed, so either it skips the hook or this
+	 * waits for it. */
+	removed->removed.store(true);
+	impl->hooks_condition.wait(lock, [&]{ return removed->busy.load() == 0; });
+}
+
+AGO_TEMPLATE
+void AGO_CLASS::at_return(std::function<void()> func)
+{
+	worker *w = ago_impl::current;
+	if(w && w->pool == impl.get()) w->at_return.push_back(std::move(func));
+	else func();
+}
+
+AGO_TEMPLATE
+AGO_CLASS::blocking_region::blocking_region(basic_ago &pool)
+	: pool(nullptr)
+{
+	worker *w = ago_impl::current;
+	if(!w || w->pool != pool.impl.get()) return;
+
+	this->pool = &pool;
+	if(w->blocking_depth++ == 0) pool.enter_blocking();
+}
+
+AGO_TEMPLATE
+AGO_CLASS::blocking_region::~blocking_region()
+{
+	if(pool && --ago_impl::current->blocking_depth == 0) pool->leave_blocking();
+}
+
+AGO_TEMPLATE
+void AGO_CLASS::enter_blocking()
+{
+	ago_lock_guard lock(impl->func_mutex, "ago::enter_blocking");
+	++impl->blocked;
+	balance();
+}
+
+AGO_TEMPLATE
+void AGO_CLASS::leave_blocking()
+{
+	ago_lock_guard lock(impl->func_mutex, "ago::leave_blocking");
+	--impl->blocked;
+	if(impl->enabled_spares > impl->blocked)
+	{
+		int spare = impl->max_conc + --impl->enabled_spares;
+
+		/* if it is parked, move it to sleep as retired */
+		worker *w = impl->workers[spare];
+		w->retired = true;
+		if(w->parked)
+		{
+			impl->parked_list.erase(std::find(begin(impl->parked_list),
+				end(impl->parked_list), spare));
+			w->parked = false;
+			w->run_condition.notify_one();
+		}
+	}
+	balance();
+}
+
+/* Hand out free budget, spares first. Called with the lock held. */
+AGO_TEMPLATE
+void AGO_CLASS::balance()
+{
+	/* the destructor has taken the list of threads to join */
+	if(impl->ago_quit) return;
+
+	int spares = (int)impl->workers.size() - impl->max_conc;
+	while(impl->enabled_spares < impl->blocked && impl->enabled_spares < spares &&
+		impl->enabled_spares + impl->blocking_threads < impl->max_spare)
+	{
+		worker *w = impl->workers[impl->max_conc + impl->enabled_spares++];
+		w->retired = false;
+		if(!w->thread) w->thread = new std::thread(&basic_ago::static_idle, this, w->index);
+		else w->run_condition.notify_one();
+	}
+
+	/* idle blocking threads make way */
+	bool starved = impl->spares_starved();
+	if(starved && impl->blocking_idle) impl->blocking_condition.notify_all();
+
+	/* One blocking thread is allowed beyond the budget, or with a
+	 * max_spare or blocking_limits() of 0, or while the spares take it
+	 * all, nothing would ever run go_blocking() functions. */
+	if(!impl->blocking_list.empty() && !impl->blocking_idle &&
+		(impl->blocking_threads == 0 || (!starved &&
+		impl->blocking_threads < impl->max_blocking &&
+		impl->enabled_spares + impl->blocking_threads < impl->max_spare)))
+	{
+		++impl->blocking_threads;
+		std::thread(&basic_ago::blocking_thread, this).detach();
+	}
+}
+
+AGO_TEMPLATE
+void AGO_CLASS::blocking_limits(int max, int keep_alive_ms)
+{
+	ago_lock_guard lock(impl->func_mutex, "ago::blocking_limits");
+	impl->max_blocking = max;
+	impl->keep_alive = std::chrono::milliseconds(keep_alive_ms);
+	impl->blocking_condition.notify_all();
+	balance();
+}
+
+AGO_TEMPLATE
+void AGO_CLASS::submit_blocking(task *t)
+{
+	impl->submitted();
+	t->queued_ns = 0;
+	t->trace_id = ago_detail::trace_submit();
+
+	ago_lock_guard lock(impl->func_mutex, "ago::go_blocking");
+	impl->blocking_list.push(t);
+	++impl->pending;
+	if(impl->blocking_idle) impl->blocking_condition.notify_one();
+	else balance();
+}
+
+/* A thread for go_blocking() functions. It is detached, and the last
+ * thing it does is release the lock after counting itself out, which
+ * the destructor waits for. */
+AGO_TEMPLATE
+void AGO_CLASS::blocking_thread()
+{
+	ago_trace::name_thread("ago blocking");
+	std::unique_lock<std::mutex> lock = impl->func_mutex.lock_native("ago::blocking_thread");
+
+	while(1)
+	{
+		/* wait for a function; give up after keep_alive without one, or
+		 * at once if a spare needs the budget */
+		++impl->blocking_idle;
+		impl->blocking_condition.wait_for(lock, impl->keep_alive, [&]{
+			return impl->ago_quit || !impl->blocking_list.empty() || impl->spares_starved();
+		});
+		--impl->blocking_idle;
+		if(impl->ago_quit || impl->blocking_list.empty()) break;
+
+		task *t = impl->blocking_list.pop();
+		lock.unlock();
+
+		worker *owner = t->owner;
+		std::uint64_t trace_id = t->trace_id;
+		bool traced = ago_trace::enabled();
+		if(traced) ago_trace::record(ago_trace::run_begin, trace_id);
+		t->invoke(t, true);
+		if(traced) ago_trace::record(ago_trace::run_end, trace_id);
+		if(owner) owner->give_block(t, nullptr);
+		else ::operator delete(t);
+		if(StatsPolicy::counters) impl->blocking_executed.fetch_add(1, std::memory_order_relaxed);
+
+		lock.lock();
+		if(--impl->pending == 0)
+		{
+			impl->idle_condition.notify_all();
+		}
+	}
+
+	--impl->blocking_threads;
+	if(!impl->ago_quit) balance();
+	impl->blocking_condition.notify_all();
+}
+
+/** Destructor. Closes up all running threads.
+ * If was in the middle of running functions, wait till they end.
+ * Can restart again by creating a new ago object.
+ */
+AGO_TEMPLATE
+AGO_CLASS::~basic_ago()
+{
+	/* Tell all threads to quit. Functions still running may enter
+	 * blocking regions, but balance() starts no thread from now on, so
+	 * the threads taken here are all there will be. */
+	std::vector<std::thread*> threads;
+	{
+		ago_lock_guard lock(impl->func_mutex, "ago::~ago");
+		impl->ago_quit = true;
+		impl->blocking_condition.notify_all();
+		impl->parked_list.clear();
+		for(auto w = begin(impl->workers); w != end(impl->workers); ++w)
+		{
+			(*w)->parked = false;
+			if((*w)->thread) threads.push_back((*w)->thread);
+		}
+	}
+
+	/* Notify all threads to stop waiting. */
+	for(auto w = begin(impl->workers); w != end(impl->workers); ++w)
+	{
+		(*w)->run_condition.notify_one();
+	}
+
+	/* wait for all threads to quit */
+	for(auto t = begin(threads); t != end(threads); ++t)
+	{
+		(*t)->join();
+	}
+
+	/* and for the blocking threads, which were detached */
+	{
+		std::unique_lock<std::mutex> lock = impl->func_mutex.lock_native("ago::~ago");
+		impl->blocking_condition.wait(lock, [&]{ return impl->blocking_threads == 0; });
+	}
+
+	/* destroy functions that never ran, while their blocks' owners exist */
+	ago_detail::discard(impl->func_list);
+	ago_detail::discard(impl->blocking_list);
+	for(auto w = begin(impl->workers); w != end(impl->workers); ++w)
+	{
+		ago_detail::discard((*w)->keyed_list);
+		if((*w)->next)
+		{
+			task_list next;
+			next.push((*w)->next);
+			ago_detail::discard(next);
+		}
+	}
+
+	/* delete all threads */
+	while( !impl->workers.empty() )
+	{
+		auto w = impl->workers.back();
+		delete w->thread;
+		ago_detail::free_blocks(w->cache);
+		ago_detail::free_blocks(w->returned.load(std::memory_order_relaxed));
+		delete w;
+		impl->workers.pop_back();
+	}
+	ago_detail::free_blocks(impl->outside->cache);
+	ago_detail::free_blocks(impl->outside->returned.load(std::memory_order_relaxed));
+	delete impl->outside;
+}
+
+/** Execute function func in parallel.
+ * */
+AGO_TEMPLATE
+void AGO_CLASS::go(std::function<void()> func)
+{
+	submit(make_task(std::move(func)));
+}
+
+AGO_TEMPLATE
+void *AGO_CLASS::alloc_task(std::size_t size, worker *&owner)
+{
+	/* Every block is given back before its owner is deleted, since the
+	 * pool destroys the functions it has not run. */
+	if(size <= TaskPolicy::block_size)
+	{
+		worker *w = ago_impl::current;
+		if(w && w->pool == impl.get())
+		{
+			owner = w;
+			return w->take_block();
+		}
+
+		std::lock_guard<std::mutex> lock(impl->outside_mutex);
+		owner = impl->outside;
+		return owner->take_block();
+	}
+	owner = nullptr;
+	return ::operator new(size);
+}
+
+AGO_TEMPLATE
+void AGO_CLASS::submit(task *t)
+{
+	worker *wake = nullptr;
+	int wake_index = 0;
+	impl->submitted();
+	t->queued_ns = impl->queued_ns();
+	t->trace_id = ago_detail::trace_submit();
+
+	/* A pool thread runs what it submits next. Whatever was there before
+	 * goes to the queue. */
+	worker *self = QueuePolicy::run_next ? ago_impl::current : nullptr;
+	if(self && self->pool != impl.get()) self = nullptr;
+
+	/* add function to queue, and claim a parked thread if there is one */
+	{
+		ago_lock_guard lock(impl->func_mutex, "ago::go");
+		if(!self)
+		{
+			impl->func_list.push(t);
+		}
+		else
+		{
+			if(self->next) impl->func_list.push(self->next);
+			else ++impl->next_count;
+			self->next = t;
+		}
+		++impl->pending;
+
+		wake = impl->claim_parked();
+		if(wake) wake_index = wake->index;
+	}
+
+	/* Tell that thread to wake up and execute the function. If none was
+	 * parked they are all busy and will find it when they finish. */
+	if(wake)
+	{
+		if(ago_trace::enabled()) ago_trace::record(ago_trace::wake, wake_index);
+		wake->run_condition.notify_one();
+	}
+}
+
+/** Execute function func on the thread owning hash.
+ * */
+AGO_TEMPLATE
+void AGO_CLASS::submit_keyed(std::size_t hash, task *t)
+{
+	/* std::hash is the identity for integers in common libraries, so mix
+	 * the bits before reducing to a worker index. */
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+
+	int index = (int)(hash % impl->max_conc);
+	worker *w = impl->workers[index];
+	bool wake = false;
+	impl->submitted();
+	t->queued_ns = impl->queued_ns();
+	t->trace_id = ago_detail::trace_submit();
+
+	{
+		ago_lock_guard lock(impl->func_mutex, "ago::go_keyed");
+		w->keyed_list.push(t);
+		++impl->pending;
+
+		if(w->parked)
+		{
+			impl->parked_list.erase(std::find(begin(impl->parked_list),
+				end(impl->parked_list), index));
+			w->parked = false;
+			wake = true;
+		}
+	}
+
+	if(wake)
+	{
+		if(ago_trace::enabled()) ago_trace::record(ago_trace::wake, index);
+		w->run_condition.notify_one();
+	}
+}
+
+/** Idling function.
+ * Designed to block (not do anything) until a function has been
+ * assigned to it.
+ * See description at top of file.
+ */
+AGO_TEMPLATE
+void AGO_CLASS::static_idle(basic_ago *obj, int index)
+{
+	obj->idle(index);
+}
+AGO_TEMPLATE
+void AGO_CLASS::idle(int index)
+{
+	worker *self = impl->workers[index];
+	task *t = nullptr;
+	ago_impl::current = self;
+	ago_trace::name_thread("ago worker " + std::to_string(index));
+	std::uint64_t since = ago_detail::now_ns();
+
+	/* idling loop */
+	bool finished = false;
+	while(1){
+
+		{
+			/* Atomically wait until a function is added to one of our
+			 * lists, or the quit variable is set.
+			 */
+			std::unique_lock<std::mutex> lock = impl->func_mutex.lock_native("ago::idle");
+
+			/* Account for the function we just ran while we hold the
+			 * lock anyway, rather than locking again after each one. */
+			if(finished && --impl->pending == 0)
+			{
+				impl->idle_condition.notify_all();
+			}
+
+			bool trimmed = false;
+			bool delayed = false;
+			bool spun = false;
+			worker *victim = nullptr;
+			while(!impl->ago_quit && (self->retired || (!self->next &&
+				self->keyed_list.empty() && impl->func_list.empty())))
+			{
+				/* Only another thread's next function is left. Give that
+				 * thread a moment to take it, then take it ourselves. */
+				if(!self->retired && (victim = impl->next_victim(self)))
+				{
+					if(delayed) break;
+					delayed = true;
+					victim = nullptr;
+					lock.unlock();
+					std::uint64_t until = ago_detail::now_ns() + ago_detail::steal_delay_ns;
+					while(ago_detail::now_ns() < until) std::this_thread::yield();
+					lock.lock();
+					continue;
+				}
+
+				/* Nothing to do, so give back spare blocks and run the
+				 * idle hooks first. That is done without the lock, so look
+				 * again afterwards. */
+				if(!trimmed && (self->over(TaskPolicy::cache_keep) || !impl->idle_hooks->empty()))
+				{
+					trimmed = true;
+					std::shared_ptr<const typename ago_impl::hook_list> hooks = impl->idle_hooks;
+					lock.unlock();
+
+					self->trim(TaskPolicy::cache_keep);
+					bool removing = false;
+					for(auto h = hooks->begin(); h != hooks->end(); ++h)
+					{
+						typename ago_impl::idle_hook &hook = **h;
+						++hook.busy;
+						if(!hook.removed.load()) hook.func(index);
+						if(--hook.busy == 0 && hook.removed.load()) removing = true;
+					}
+
+					/* whoever removes a hook waits for it under the lock */
+					lock.lock();
+					if(removing) impl->hooks_condition.notify_all();
+					continue;
+				}
+
+				/* A spare that is no longer needed hands its next function
+				 * to the queue and sleeps until it is enabled again. */
+				if(self->retired)
+				{
+					if(self->next)
+					{
+						impl->func_list.push(self->next);
+						self->next = nullptr;
+						--impl->next_count;
+						worker *w = impl->claim_parked();
+						if(w) w->run_condition.notify_one();
+					}
+
+					self->sleeping(since);
+					if(ago_trace::enabled()) ago_trace::record(ago_trace::park);
+
+					self->run_condition.wait(lock, [&]{ return impl->ago_quit || !self->retired; });
+
+					if(ago_trace::enabled()) ago_trace::record(ago_trace::unpark);
+					self->woken(since);
+					trimmed = false;
+					continue;
+				}
+
+				/* Keep looking for a while first if WaitPolicy says so,
+				 * taking the lock only for a moment each time. */
+				if(WaitPolicy::spin_ns && !spun)
+				{
+					spun = true;
+					std::uint64_t until = ago_detail::now_ns() + WaitPolicy::spin_ns;
+					do
+					{
+						lock.unlock();
+						std::this_thread::yield();
+						lock.lock();
+					}
+					while(!impl->ago_quit && !self->next && self->keyed_list.empty() &&
+						impl->func_list.empty() && !impl->next_count &&
+						ago_detail::now_ns() < until);
+					continue;
+				}
+
+				self->parked = true;
+				impl->parked_list.push_back(index);
+
+				self->sleeping(since);
+				if(ago_trace::enabled()) ago_trace::record(ago_trace::park);
+
+				self->run_condition.wait(lock, [&]{ return !self->parked; });
+
+				if(ago_trace::enabled()) ago_trace::record(ago_trace::unpark);
+				self->woken(since);
+				trimmed = false;
+				delayed = false;
+				spun = false;
+			}
+
+			/* are we running functions or quitting? */
+			if(impl->ago_quit) return;
+
+			/* we have been assigned. Get the details of the function. */
+			/* this must be done in a mutex to make sure two threads don't
+			 * start to run the same function, if ago::go is called rapidly
+			 * in succession */
+			bool queued = !self->keyed_list.empty() || !impl->func_list.empty();
+			if(victim)
+			{
+				t = victim->next;
+				victim->next = nullptr;
+				--impl->next_count;
+				self->count(self->stats.stolen);
+				if(ago_trace::enabled()) ago_trace::record(ago_trace::steal, t->trace_id);
+			}
+			else if(self->next && (self->next_streak < ago_detail::next_limit || !queued))
+			{
+				t = self->next;
+				self->next = nullptr;
+				--impl->next_count;
+				++self->next_streak;
+			}
+			else
+			{
+				bool keyed = !self->keyed_list.empty() &&
+					(impl->func_list.empty() || self->keyed_turn);
+				self->keyed_turn = !keyed;
+				self->next_streak = 0;
+
+				t = keyed ? self->keyed_list.pop() : impl->func_list.pop();
+			}
+		}
+
+		std::uint64_t queued_ns = t->queued_ns;
+		std::uint64_t trace_id = t->trace_id;
+		worker *owner = t->owner;
+
+		/* now run the function, timing and tracing it if asked to */
+		bool timed = StatsPolicy::latency && impl->track_latency.load(std::memory_order_relaxed);
+		bool traced = ago_trace::enabled();
+		if(!timed && !traced)
+		{
+			t->invoke(t, true);
+		}
+		else
+		{
+			if(traced) ago_trace::record(ago_trace::run_begin, trace_id);
+			std::uint64_t start = timed ? ago_detail::now_ns() : 0;
+
+			t->invoke(t, true);
+
+			if(timed)
+			{
+				std::uint64_t end = ago_detail::now_ns();
+
+				/* functions queued before tracking was turned on have
+				 * no timestamp */
+				if(queued_ns)
+				{
+					self->queue_wait.record(start - queued_ns);
+				}
+				self->run.record(end - start);
+			}
+			if(traced) ago_trace::record(ago_trace::run_end, trace_id);
+		}
+		/* the callable is destroyed; now its memory */
+		if(owner) owner->give_block(t, self);
+		else ::operator delete(t);
+
+		/* these may add more */
+		for(std::size_t i = 0; i < self->at_return.size(); ++i)
+		{
+			std::function<void()> f = std::move(self->at_return[i]);
+			f();
+		}
+		self->at_return.clear();
+		finished = true;
+		self->count(self->stats.executed);
+	}
+}
+
+#undef AGO_TEMPLATE
+#undef AGO_CLASS
+
+#endif	/* AGO_IMPL_H */
@@ -0,0 +1,497 @@
+/* asynchronous reads and writes for ago */
+
+/* With io_uring, a function running on the pool that starts an operation
+ * only writes its submission entry into a list kept by its own thread,
+ * and registers with ago::at_return() to flush that list when it
+ * returns. The flush copies the entries into the ring and enters the
+ * kernel once, under a mutex, so a function that starts many operations
+ * makes one system call. Threads outside the pool submit each operation
+ * straight away.
+ *
+ * Each entry carries a heap allocated record holding the done function.
+ * A reaper thread sleeps in io_uring_enter() until a completion arrives,
+ * then takes every completion in the ring and gives each done function to
+ * ago::go(). Pool threads do the same from an idle hook before they park,
+ * which also flushes anything their thread still holds, so completions
+ * that are already there do not wait for the reaper to be scheduled.
+ *
+ * At most entries operations are started and not yet completed, which is
+ * never more than the ring holds. A thread that would start one more
+ * first flushes its own list, so it never waits on operations that only
+ * it could submit.
+ *
+ * Without io_uring the operations are given to a small ago pool of their
+ * own, whose threads make the blocking calls.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "ago_io.h"
+
+namespace
+{
+	/* threads making blocking calls when there is no io_uring */
+	const int blocking_threads = 8;
+
+	/* The most one operation asks for: what Linux moves in one read() or
+	 * write() anyway, and within the 32 bit length of a ring entry. More
+	 * is reported as a partial transfer, as the calls themselves do. */
+	const std::size_t max_transfer = 0x7ffff000;
+
+	/* a started operation */
+	struct op
+	{
+		explicit op(std::function<void(long)> &&d) : done(std::move(d)) {}
+
+		std::function<void(long)> done;
+	};
+
+	/* an operation's result, given to ago::go() */
+	struct completion
+	{
+		completion(std::function<void(long)> &&d, long r) : done(std::move(d)), res(r) {}
+
+		void operator()() { done(res); }
+
+		std::function<void(long)> done;
+		long res;
+	};
+}
+
+struct ago_io::io_impl : std::enable_shared_from_this<ago_io::io_impl>
+{
+	ago *pool;
+	unsigned limit;
+
+	/* operations started and not completed */
+	std::size_t in_flight;
+	std::mutex flight_mutex;
+	std::condition_variable flight_condition;
+
+	/* wait for room for one more operation */
+	void reserve();
+
+	/* an operation has completed and its done function is queued */
+	void finished(std::size_t n);
+
+	/* the blocking fallback */
+	std::unique_ptr<ago> threads;
+
+	void blocking(bool is_read, int fd, void *buf, std::size_t len,
+		std::int64_t offset, std::function<void(long)> &&done);
+
+#ifdef __linux__
+	bool uring;
+	int ring_fd;
+
+	/* the shared rings, under ring_mutex */
+	std::mutex ring_mutex;
+	void *sq_ptr;
+	void *cq_ptr;
+	std::size_t sq_size;
+	std::size_t cq_size;
+	io_uring_sqe *sqes;
+	std::size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	io_uring_cqe *cqes;
+
+	/* entries each pool thread has yet to submit */
+	struct slot
+	{
+		slot() : flush_scheduled(false) {}
+
+		/* keep neighbouring lists off each other's cache lines */
+		char pad_before[64];
+		std::vector<io_uring_sqe> pending;
+		bool flush_scheduled;
+		char pad_after[64];
+	};
+	std::vector<slot> slots;
+
+	std::thread *reaper;
+	int hook;
+
+	bool setup(unsigned entries);
+	void teardown();
+	int enter(unsigned to_submit, unsigned min_complete, unsigned flags);
+	void start(io_uring_sqe &sqe, std::function<void(long)> &&done);
+	void submit(const io_uring_sqe *entries, std::size_t n);
+	void flush(int index);
+	bool reap();
+	void reap_loop();
+#endif
+};
+
+void ago_io::io_impl::reserve()
+{
+	std::unique_lock<std::mutex> lock(flight_mutex);
+	if(in_flight >= limit)
+	{
+#ifdef __linux__
+		/* the operations we hold count too, and only we can submit them */
+		int index = pool->worker_index();
+		if(uring && index >= 0 && !slots[index].pending.empty())
+		{
+			lock.unlock();
+			flush(index);
+			lock.lock();
+		}
+#endif
+		flight_condition.wait(lock, [&]{ return in_flight < limit; });
+	}
+	++in_flight;
+}
+
+void ago_io::io_impl::finished(std::size_t n)
+{
+	std::lock_guard<std::mutex> lock(flight_mutex);
+	in_flight -= n;
+	flight_condition.notify_all();
+}
+
+void ago_io::io_impl::blocking(bool is_read, int fd, void *buf, std::size_t len,
+	std::int64_t offset, std::function<void(long)> &&done)
+{
+	struct call
+	{
+		io_impl *io;
+		bool is_read;
+		int fd;
+		void *buf;
+		std::size_t len;
+		std::int64_t offset;
+		std::function<void(long)> done;
+
+		void operator()()
+		{
+			long res;
+			if(is_read)
+			{
+				res = offset < 0 ? (long)::read(fd, buf, len) :
+					(long)::pread(fd, buf, len, (off_t)offset);
+			}
+			else
+			{
+				res = offset < 0 ? (long)::write(fd, buf, len) :
+					(long)::pwrite(fd, buf, len, (off_t)offset);
+			}
+			if(res < 0) res = -errno;
+
+			io->pool->go(completion(std::move(done), res));
+			io->finished(1);
+		}
+	};
+
+	call c = { this, is_read, fd, buf, len, offset, std::move(done) };
+	threads->go(std::move(c));
+}
+
+#ifdef __linux__
+
+bool ago_io::io_impl::setup(unsigned entries)
+{
+	io_uring_params p;
+	std::memset(&p, 0, sizeof(p));
+	ring_fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if(ring_fd < 0) return false;
+
+	/* reads and writes at the current position and good socket support
+	 * came together with fast poll */
+	if(!(p.features & IORING_FEAT_FAST_POLL))
+	{
+		close(ring_fd);
+		return false;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if(single) sq_size = cq_size = std::max(sq_size, cq_size);
+
+	sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring_fd, IORING_OFF_SQ_RING);
+	cq_ptr = single ? sq_ptr : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if(sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		if(sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+		if(!single && cq_ptr != MAP_FAILED) munmap(cq_ptr, cq_size);
+		if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+		close(ring_fd);
+		return false;
+	}
+
+	char *sq = (char*)sq_ptr;
+	char *cq = (char*)cq_ptr;
+	sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned*)(sq + p.sq_off.array);
+	cq_head = (unsigned*)(cq + p.cq_off.head);
+	cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	/* never more in flight than the rings hold */
+	limit = std::min(limit, p.sq_entries);
+	return true;
+}
+
+void ago_io::io_impl::teardown()
+{
+	munmap(sqes, sqes_size);
+	if(cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+	munmap(sq_ptr, sq_size);
+	close(ring_fd);
+}
+
+int ago_io::io_impl::enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+		nullptr, 0);
+}
+
+void ago_io::io_impl::start(io_uring_sqe &sqe, std::function<void(long)> &&done)
+{
+	reserve();
+	sqe.user_data = (std::uint64_t)(std::uintptr_t)new op(std::move(done));
+
+	int index = pool->worker_index();
+	if(index < 0)
+	{
+		submit(&sqe, 1);
+		return;
+	}
+
+	slot &s = slots[index];
+	s.pending.push_back(sqe);
+	if(!s.flush_scheduled)
+	{
+		s.flush_scheduled = true;
+
+		/* the function may go on to destroy the ago_io */
+		std::shared_ptr<io_impl> self = shared_from_this();
+		pool->at_return([self, index]{ self->flush(index); });
+	}
+}
+
+void ago_io::io_impl::submit(const io_uring_sqe *entries, std::size_t n)
+{
+	std::lock_guard<std::mutex> lock(ring_mutex);
+
+	/* only we write the tail, and there is always room */
+	unsigned tail = *sq_tail;
+	for(std::size_t i = 0; i < n; ++i, ++tail)
+	{
+		unsigned index = tail & *sq_mask;
+		sqes[index] = entries[i];
+		sq_array[index] = index;
+	}
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+	std::size_t submitted = 0;
+	while(submitted < n)
+	{
+		int r = enter((unsigned)(n - submitted), 0, 0);
+		if(r < 0)
+		{
+			/* anything left is picked up by the next enter */
+			if(errno != EINTR && errno != EAGAIN && errno != EBUSY) break;
+			std::this_thread::yield();
+			continue;
+		}
+		submitted += r;
+	}
+}
+
+void ago_io::io_impl::flush(int index)
+{
+	slot &s = slots[index];
+	s.flush_scheduled = false;
+	if(s.pending.empty()) return;
+	submit(s.pending.data(), s.pending.size());
+	s.pending.clear();
+}
+
+/* Give every completion in the ring to the pool. Returns false once the
+ * reaper's quit entry has been seen. */
+bool ago_io::io_impl::reap()
+{
+	if(__atomic_load_n(cq_head, __ATOMIC_RELAXED) == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+	{
+		return true;
+	}
+
+	std::vector<std::pair<op*, long>> done;
+	{
+		std::lock_guard<std::mutex> lock(ring_mutex);
+		unsigned head = *cq_head;
+		unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail; ++head)
+		{
+			const io_uring_cqe &cqe = cqes[head & *cq_mask];
+			done.push_back(std::make_pair((op*)(std::uintptr_t)cqe.user_data, (long)cqe.res));
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	bool quit = false;
+	std::size_t ops = 0;
+	for(auto d = done.begin(); d != done.end(); ++d)
+	{
+		if(!d->first)
+		{
+			quit = true;
+			continue;
+		}
+		pool->go(completion(std::move(d->first->done), d->second));
+		delete d->first;
+		++ops;
+	}
+	if(ops) finished(ops);
+	return !quit;
+}
+
+void ago_io::io_impl::reap_loop()
+{
+	do
+	{
+		enter(0, 1, IORING_ENTER_GETEVENTS);
+	}
+	while(reap());
+}
+
+#endif	/* __linux__ */
+
+ago_io::ago_io(ago &pool, unsigned entries, bool use_uring)
+	: impl(new io_impl)
+{
+	impl->pool = &pool;
+	impl->limit = entries ? entries : 1;
+	impl->in_flight = 0;
+
+#ifdef __linux__
+	impl->uring = use_uring && impl->setup(impl->limit);
+	if(impl->uring)
+	{
+		impl->slots = std::vector<io_impl::slot>(pool.worker_slots());
+		io_impl *io = impl.get();
+		impl->hook = pool.add_idle_hook([io](int index){
+			io->flush(index);
+			io->reap();
+		});
+		impl->reaper = new std::thread([io]{ io->reap_loop(); });
+		return;
+	}
+#endif
+	impl->threads.reset(new ago(blocking_threads));
+}
+
+/* Wait for everything started to complete before letting go of the ring. */
+ago_io::~ago_io()
+{
+	flush();
+	{
+		std::unique_lock<std::mutex> lock(impl->flight_mutex);
+		impl->flight_condition.wait(lock, [&]{ return impl->in_flight == 0; });
+	}
+
+#ifdef __linux__
+	if(impl->uring)
+	{
+		impl->pool->remove_idle_hook(impl->hook);
+
+		/* a no-op with no record tells the reaper to quit */
+		io_uring_sqe quit;
+		std::memset(&quit, 0, sizeof(quit));
+		quit.opcode = IORING_OP_NOP;
+		impl->submit(&quit, 1);
+		impl->reaper->join();
+		delete impl->reaper;
+		impl->teardown();
+	}
+#endif
+	impl->threads.reset();
+}
+
+void ago_io::read(int fd, void *buf, std::size_t len, std::int64_t offset,
+	std::function<void(long)> done)
+{
+#ifdef __linux__
+	if(impl->uring)
+	{
+		io_uring_sqe sqe;
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_READ;
+		sqe.fd = fd;
+		sqe.addr = (std::uint64_t)(std::uintptr_t)buf;
+		sqe.len = (unsigned)std::min(len, max_transfer);
+		sqe.off = (std::uint64_t)offset;
+		impl->start(sqe, std::move(done));
+		return;
+	}
+#endif
+	impl->reserve();
+	impl->blocking(true, fd, buf, std::min(len, max_transfer), offset, std::move(done));
+}
+
+void ago_io::write(int fd, const void *buf, std::size_t len, std::int64_t offset,
+	std::function<void(long)> done)
+{
+#ifdef __linux__
+	if(impl->uring)
+	{
+		io_uring_sqe sqe;
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_WRITE;
+		sqe.fd = fd;
+		sqe.addr = (std::uint64_t)(std::uintptr_t)buf;
+		sqe.len = (unsigned)std::min(len, max_transfer);
+		sqe.off = (std::uint64_t)offset;
+		impl->start(sqe, std::move(done));
+		return;
+	}
+#endif
+	impl->reserve();
+	impl->blocking(false, fd, const_cast<void*>(buf), std::min(len, max_transfer), offset,
+		std::move(done));
+}
+
+void ago_io::flush()
+{
+#ifdef __linux__
+	int index = impl->pool->worker_index();
+	if(impl->uring && index >= 0) impl->flush(index);
+#endif
+}
+
+bool ago_io::uring() const
+{
+#ifdef __linux__
+	return impl->uring;
+#else
+	return false;
+#endif
+}
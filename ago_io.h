@@ -0,0 +1,60 @@
+#ifndef AGO_IO_H
+#define AGO_IO_H
+
+#include <memory>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+#include "ago.h"
+
+/* Reads and writes that do not hold up a thread of an ago pool.
+ *
+ * Each call starts the operation and returns at once. When it completes,
+ * done is given to ago::go() with the number of bytes transferred, or
+ * minus the errno value on failure. The buffer must stay valid until
+ * then. An offset of -1 reads or writes at the current position, as for
+ * sockets and pipes. As with read() and write(), fewer bytes than asked
+ * may be transferred, and at most 0x7ffff000 are in one operation.
+ *
+ * On Linux with io_uring the operations go through one ring per ago_io.
+ * Operations started by a function running on the pool are submitted
+ * together when that function returns, so a function that starts many
+ * costs one system call. Completions are collected by a thread that
+ * sleeps in the kernel, and by pool threads as they run out of work.
+ * Elsewhere, or if io_uring is unavailable, a few threads of their own
+ * make the blocking calls instead.
+ *
+ * The destructor waits for operations in progress to complete; it must
+ * run before the ago object is destroyed.
+ */
+class ago_io
+{
+public:
+	/* entries: operations in progress before starting another waits;
+	 * use_uring: false makes the blocking calls even where io_uring is
+	 * available */
+	explicit ago_io(ago &pool, unsigned entries = 256, bool use_uring = true);
+	virtual ~ago_io();
+
+	void read(int fd, void *buf, std::size_t len, std::int64_t offset,
+		std::function<void(long)> done);
+	void write(int fd, const void *buf, std::size_t len, std::int64_t offset,
+		std::function<void(long)> done);
+
+	/* submit whatever the calling function has started so far now rather
+	 * than when it returns */
+	void flush();
+
+	/* whether io_uring is in use rather than blocking threads */
+	bool uring() const;
+
+private:
+	ago_io(const ago_io &);
+	ago_io &operator=(const ago_io &);
+
+	struct io_impl;
+	std::shared_ptr<io_impl> impl;
+};
+
+#endif	/* AGO_IO_H */
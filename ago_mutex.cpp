@@ -0,0 +1,6 @@
+/* contention profiling mutex for ago */
+
+/* The definitions are in ago_mutex_impl.h, which header-only builds
+ * include instead. */
+
+#include "ago_mutex_impl.h"
@@ -0,0 +1,102 @@
+#ifndef AGO_MUTEX_H
+#define AGO_MUTEX_H
+
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "ago_config.h"
+
+#define AGO_STRINGIZE_(x) #x
+#define AGO_STRINGIZE(x) AGO_STRINGIZE_(x)
+
+/* "file:line" of the place it is written, for ago_lock_guard */
+#define AGO_LOCK_SITE __FILE__ ":" AGO_STRINGIZE(__LINE__)
+
+/* A std::mutex that can profile its own contention.
+ *
+ * An uncontended lock is a try_lock plus one relaxed store of the
+ * caller's site. When the lock is contended and profiling is on, the time
+ * spent waiting is added to a per thread table under (mutex, site of the
+ * waiter, site of the holder at the time), with no shared state touched.
+ * report() merges every thread's table.
+ *
+ * Sites and names must be string literals or otherwise outlive the
+ * program's use of the profile; they are compared by address.
+ */
+class ago_mutex
+{
+public:
+	explicit ago_mutex(const char *name = "ago_mutex");
+
+	void lock() { lock(name); }
+	void lock(const char *site);
+	bool try_lock();
+	void unlock() { m.unlock(); }
+
+	/* Lock like lock(site), but return a lock on the underlying mutex so
+	 * that a std::condition_variable can wait on it. Relocking after a
+	 * wait goes around the profile. */
+	std::unique_lock<std::mutex> lock_native(const char *site);
+
+	struct site_stats
+	{
+		const char *mutex;
+		const char *site;		/* where the waiter locked */
+		const char *holder;		/* where the holder locked */
+		std::uint64_t contended;	/* acquisitions that had to wait */
+		std::uint64_t wait_ns;
+		std::uint64_t max_wait_ns;
+	};
+
+	/* Turn contention profiling on or off for every ago_mutex. Off by
+	 * default. */
+	static void profile(bool on);
+
+	/* everything recorded so far, most total waiting first */
+	static std::vector<site_stats> report();
+
+	/* the top entries of report(), one line each */
+	static void write_report(std::ostream &out, std::size_t top);
+
+private:
+	ago_mutex(const ago_mutex &);
+	ago_mutex &operator=(const ago_mutex &);
+
+	std::mutex m;
+	const char *name;
+	std::atomic<const char*> holder;
+
+	/* a static of an inline function, so that it needs no library */
+	static std::atomic<bool> &profiling()
+	{
+		static std::atomic<bool> on(false);
+		return on;
+	}
+
+	static void record(const char *mutex, const char *site, const char *holder,
+		std::uint64_t wait_ns);
+};
+
+/* std::lock_guard for ago_mutex that says where the lock is taken */
+class ago_lock_guard
+{
+public:
+	ago_lock_guard(ago_mutex &m, const char *site) : m(m) { m.lock(site); }
+	~ago_lock_guard() { m.unlock(); }
+
+private:
+	ago_lock_guard(const ago_lock_guard &);
+	ago_lock_guard &operator=(const ago_lock_guard &);
+
+	ago_mutex &m;
+};
+
+#ifdef AGO_HEADER_ONLY
+#include "ago_mutex_impl.h"
+#endif
+
+#endif	/* AGO_MUTEX_H */
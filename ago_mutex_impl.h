@@ -0,0 +1,271 @@
+#ifndef AGO_MUTEX_IMPL_H
+#define AGO_MUTEX_IMPL_H
+
+/* contention profiling mutex for ago */
+
+/* Each thread that waits for a contended ago_mutex while profiling is on
+ * gets a fixed size open addressing table, registered once in a list
+ * under a mutex. Entries are keyed by the addresses of the mutex name,
+ * the waiter's site and the holder's site, and their counters are
+ * atomics written only by the owning thread, so report() can read them
+ * at any time. When a thread exits its table is folded into a shared
+ * table of retired entries, so the list only holds live threads. A table
+ * that fills up counts further sites against one overflow entry.
+ *
+ * The shared state is kept in statics of functions rather than at
+ * namespace scope, so that a header-only build has one copy of it.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include "ago_mutex.h"
+
+namespace ago_mutex_detail
+{
+	const std::size_t table_size = 256;
+
+	AGO_INLINE const char *overflow_site()
+	{
+		static const char site[] = "(other)";
+		return site;
+	}
+
+	struct entry
+	{
+		std::atomic<const char*> mutex;
+		std::atomic<const char*> site;
+		std::atomic<const char*> holder;
+		std::atomic<std::uint64_t> contended;
+		std::atomic<std::uint64_t> wait_ns;
+		std::atomic<std::uint64_t> max_wait_ns;
+	};
+
+	struct table;
+
+	struct registry_state
+	{
+		std::mutex m;
+		std::vector<table*> tables;
+		std::vector<ago_mutex::site_stats> retired;
+	};
+
+	AGO_INLINE registry_state &registry()
+	{
+		static registry_state r;
+		return r;
+	}
+
+	AGO_INLINE void merge(std::vector<ago_mutex::site_stats> &into, const ago_mutex::site_stats &s)
+	{
+		for(auto i = into.begin(); i != into.end(); ++i)
+		{
+			if(i->mutex == s.mutex && i->site == s.site && i->holder == s.holder)
+			{
+				i->contended += s.contended;
+				i->wait_ns += s.wait_ns;
+				i->max_wait_ns = std::max(i->max_wait_ns, s.max_wait_ns);
+				return;
+			}
+		}
+		into.push_back(s);
+	}
+
+	struct table
+	{
+		table()
+		{
+			for(std::size_t i = 0; i < table_size; ++i)
+			{
+				entries[i].mutex.store(nullptr, std::memory_order_relaxed);
+			}
+			registry_state &r = registry();
+			std::lock_guard<std::mutex> lock(r.m);
+			r.tables.push_back(this);
+		}
+
+		~table()
+		{
+			registry_state &r = registry();
+			std::lock_guard<std::mutex> lock(r.m);
+			r.tables.erase(std::find(r.tables.begin(), r.tables.end(), this));
+			for(std::size_t i = 0; i < table_size; ++i)
+			{
+				if(entries[i].mutex.load(std::memory_order_relaxed))
+				{
+					merge(r.retired, read(entries[i]));
+				}
+			}
+		}
+
+		static ago_mutex::site_stats read(const entry &e)
+		{
+			ago_mutex::site_stats s;
+			s.mutex = e.mutex.load(std::memory_order_acquire);
+			s.site = e.site.load(std::memory_order_relaxed);
+			s.holder = e.holder.load(std::memory_order_relaxed);
+			s.contended = e.contended.load(std::memory_order_relaxed);
+			s.wait_ns = e.wait_ns.load(std::memory_order_relaxed);
+			s.max_wait_ns = e.max_wait_ns.load(std::memory_order_relaxed);
+			return s;
+		}
+
+		/* the entry for this key, claimed if new; only the owner calls */
+		entry &find(const char *mutex, const char *site, const char *holder)
+		{
+			std::size_t h = (std::size_t)mutex * 31 + (std::size_t)site * 17 + (std::size_t)holder;
+			h ^= h >> 7;
+			for(std::size_t probe = 0; probe < table_size - 1; ++probe)
+			{
+				entry &e = entries[(h + probe) % (table_size - 1)];
+				const char *m = e.mutex.load(std::memory_order_relaxed);
+				if(!m)
+				{
+					e.site.store(site, std::memory_order_relaxed);
+					e.holder.store(holder, std::memory_order_relaxed);
+					e.contended.store(0, std::memory_order_relaxed);
+					e.wait_ns.store(0, std::memory_order_relaxed);
+					e.max_wait_ns.store(0, std::memory_order_relaxed);
+					e.mutex.store(mutex, std::memory_order_release);
+					return e;
+				}
+				if(m == mutex && e.site.load(std::memory_order_relaxed) == site &&
+					e.holder.load(std::memory_order_relaxed) == holder)
+				{
+					return e;
+				}
+			}
+
+			/* full: the last slot collects everything else */
+			entry &e = entries[table_size - 1];
+			if(!e.mutex.load(std::memory_order_relaxed))
+			{
+				e.site.store(overflow_site(), std::memory_order_relaxed);
+				e.holder.store(overflow_site(), std::memory_order_relaxed);
+				e.contended.store(0, std::memory_order_relaxed);
+				e.wait_ns.store(0, std::memory_order_relaxed);
+				e.max_wait_ns.store(0, std::memory_order_relaxed);
+				e.mutex.store(overflow_site(), std::memory_order_release);
+			}
+			return e;
+		}
+
+		entry entries[table_size];
+	};
+
+	/* created on the first contended lock a thread profiles */
+	AGO_INLINE table &own_table()
+	{
+		thread_local table t;
+		return t;
+	}
+
+	inline void bump(std::atomic<std::uint64_t> &counter, std::uint64_t n)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+	}
+
+	inline std::uint64_t now_ns()
+	{
+		return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+}
+
+AGO_INLINE ago_mutex::ago_mutex(const char *name)
+	: name(name), holder(name)
+{
+}
+
+AGO_INLINE void ago_mutex::lock(const char *site)
+{
+	if(!m.try_lock())
+	{
+		if(profiling().load(std::memory_order_relaxed))
+		{
+			const char *held_by = holder.load(std::memory_order_relaxed);
+			std::uint64_t start = ago_mutex_detail::now_ns();
+			m.lock();
+			record(name, site, held_by, ago_mutex_detail::now_ns() - start);
+		}
+		else
+		{
+			m.lock();
+		}
+	}
+	holder.store(site, std::memory_order_relaxed);
+}
+
+AGO_INLINE bool ago_mutex::try_lock()
+{
+	if(!m.try_lock()) return false;
+	holder.store(name, std::memory_order_relaxed);
+	return true;
+}
+
+AGO_INLINE std::unique_lock<std::mutex> ago_mutex::lock_native(const char *site)
+{
+	lock(site);
+	return std::unique_lock<std::mutex>(m, std::adopt_lock);
+}
+
+AGO_INLINE void ago_mutex::profile(bool on)
+{
+	profiling().store(on, std::memory_order_relaxed);
+}
+
+AGO_INLINE void ago_mutex::record(const char *mutex, const char *site, const char *holder,
+	std::uint64_t wait_ns)
+{
+	ago_mutex_detail::entry &e = ago_mutex_detail::own_table().find(mutex, site, holder);
+	ago_mutex_detail::bump(e.contended, 1);
+	ago_mutex_detail::bump(e.wait_ns, wait_ns);
+	if(wait_ns > e.max_wait_ns.load(std::memory_order_relaxed))
+	{
+		e.max_wait_ns.store(wait_ns, std::memory_order_relaxed);
+	}
+}
+
+AGO_INLINE std::vector<ago_mutex::site_stats> ago_mutex::report()
+{
+	std::vector<site_stats> result;
+	{
+		ago_mutex_detail::registry_state &r = ago_mutex_detail::registry();
+		std::lock_guard<std::mutex> lock(r.m);
+		result = r.retired;
+		for(auto t = r.tables.begin(); t != r.tables.end(); ++t)
+		{
+			for(std::size_t i = 0; i < ago_mutex_detail::table_size; ++i)
+			{
+				const ago_mutex_detail::entry &e = (*t)->entries[i];
+				if(e.mutex.load(std::memory_order_acquire))
+				{
+					ago_mutex_detail::merge(result, ago_mutex_detail::table::read(e));
+				}
+			}
+		}
+	}
+
+	std::sort(result.begin(), result.end(),
+		[](const site_stats &a, const site_stats &b){ return a.wait_ns > b.wait_ns; });
+	return result;
+}
+
+AGO_INLINE void ago_mutex::write_report(std::ostream &out, std::size_t top)
+{
+	std::vector<site_stats> sites = report();
+	if(sites.size() > top) sites.resize(top);
+
+	for(auto s = sites.begin(); s != sites.end(); ++s)
+	{
+		char line[128];
+		snprintf(line, sizeof(line), "%10llu waits %12.3f ms total %10.3f ms max  ",
+			(unsigned long long)s->contended, s->wait_ns / 1e6, s->max_wait_ns / 1e6);
+		out << line << s->mutex << " at " << s->site
+			<< " held from " << s->holder << "\n";
+	}
+}
+
+#endif	/* AGO_MUTEX_IMPL_H */
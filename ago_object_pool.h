@@ -0,0 +1,148 @@
+#ifndef AGO_OBJECT_POOL_H
+#define AGO_OBJECT_POOL_H
+
+/* Reusable objects, like buffers, handed out and taken back by the
+ * threads of an ago pool.
+ *
+ * get() returns an object the calling thread put() earlier if it has one,
+ * else one from a list shared by every thread, else a new one. put()
+ * keeps the object for the calling thread, up to twice keep of them, and
+ * passes the rest to the shared list. Objects are reused as they were
+ * put, so reset them before use as needed.
+ *
+ * Whenever a thread of the pool runs out of work it frees all but keep of
+ * its own objects, and all but keep of the shared list, so what a burst of
+ * load took is given back once it has passed. Threads outside the pool
+ * only use the shared list.
+ *
+ * Objects still out when the ago_object_pool is destroyed belong to
+ * whoever holds them. It must be destroyed before the ago object.
+ *
+ * For a basic_ago with other policies, name it as Pool.
+ */
+
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+#include "ago.h"
+
+template<class T, class Pool = ago>
+class ago_object_pool
+{
+public:
+	explicit ago_object_pool(Pool &pool, std::size_t keep = 8)
+		: pool(pool), make([]{ return new T(); }), keep(keep), slots(pool.worker_slots())
+	{
+		hook = pool.add_idle_hook([this](int index){ trim(index); });
+	}
+
+	/* make() builds each new object; they are freed with delete */
+	ago_object_pool(Pool &pool, std::function<T*()> make, std::size_t keep = 8)
+		: pool(pool), make(std::move(make)), keep(keep), slots(pool.worker_slots())
+	{
+		hook = pool.add_idle_hook([this](int index){ trim(index); });
+	}
+
+	~ago_object_pool()
+	{
+		pool.remove_idle_hook(hook);
+		for(auto s = slots.begin(); s != slots.end(); ++s)
+		{
+			free(s->objects, 0);
+		}
+		free(shared, 0);
+	}
+
+	T *get()
+	{
+		int index = pool.worker_index();
+		if(index >= 0)
+		{
+			std::vector<T*> &own = slots[index].objects;
+			if(!own.empty())
+			{
+				T *obj = own.back();
+				own.pop_back();
+				return obj;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(shared_mutex);
+			if(!shared.empty())
+			{
+				T *obj = shared.back();
+				shared.pop_back();
+				return obj;
+			}
+		}
+		return make();
+	}
+
+	void put(T *obj)
+	{
+		int index = pool.worker_index();
+		if(index >= 0)
+		{
+			std::vector<T*> &own = slots[index].objects;
+			if(own.size() < 2 * keep)
+			{
+				own.push_back(obj);
+				return;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(shared_mutex);
+		shared.push_back(obj);
+	}
+
+private:
+	ago_object_pool(const ago_object_pool &);
+	ago_object_pool &operator=(const ago_object_pool &);
+
+	/* called by thread index as it runs out of work */
+	void trim(int index)
+	{
+		free(slots[index].objects, keep);
+
+		std::vector<T*> spare;
+		{
+			std::lock_guard<std::mutex> lock(shared_mutex);
+			if(shared.size() <= keep) return;
+			spare.assign(shared.begin() + keep, shared.end());
+			shared.resize(keep);
+		}
+		free(spare, 0);
+	}
+
+	static void free(std::vector<T*> &objects, std::size_t keep)
+	{
+		while(objects.size() > keep)
+		{
+			delete objects.back();
+			objects.pop_back();
+		}
+	}
+
+	struct slot
+	{
+		/* keep neighbouring lists off each other's cache lines */
+		char pad_before[64];
+		std::vector<T*> objects;
+		char pad_after[64];
+	};
+
+	Pool &pool;
+	std::function<T*()> make;
+	std::size_t keep;
+	std::vector<slot> slots;
+
+	std::mutex shared_mutex;
+	std::vector<T*> shared;
+
+	int hook;
+};
+
+#endif	/* AGO_OBJECT_POOL_H */
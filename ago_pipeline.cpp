@@ -0,0 +1,268 @@
+/* pipelines of filters for ago */
+
+/* Items travel in tokens. There are max_tokens of them, allocated by
+ * ago_pipeline::run(), and the input filter is only called when one is
+ * free. Each input call is its own function given to ago::go(); once it
+ * has an item it asks for the next input call and then carries its token
+ * through the rest of the filters itself.
+ *
+ * Parallel filters are just called. A serial filter has a busy flag: a
+ * token that finds it busy, or that is not the next in sequence for an
+ * in order filter, is parked on the filter and its function returns.
+ * Whoever leaves the filter picks the next parked token, marks the
+ * filter busy on its behalf and gives it to ago::go() to carry on.
+ * Nobody ever blocks waiting for a filter.
+ */
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+#include "ago_pipeline.h"
+
+struct ago_pipeline::pipeline_impl
+{
+	struct token
+	{
+		void *item;
+		std::size_t seq;
+		std::size_t stage;
+	};
+
+	struct filter
+	{
+		filter(mode m, std::function<void*(void*)> f)
+			: m(m), func(std::move(f)), busy(false), next_seq(0) {}
+
+		mode m;
+		std::function<void*(void*)> func;
+
+		/* serial filters only */
+		std::mutex filter_mutex;
+		bool busy;
+		std::size_t next_seq;
+		std::map<std::size_t, token*> in_order_list;
+		std::deque<token*> out_of_order_list;
+	};
+
+	/* deque so filters, which hold a mutex, never move */
+	std::deque<filter> filters;
+
+	ago *pool;
+
+	std::vector<token> tokens;
+	std::vector<token*> free_tokens;
+
+	/* input state */
+	bool input_busy;
+	bool input_done;
+	std::size_t next_seq;
+
+	bool running;
+	std::mutex pipe_mutex;
+	std::condition_variable done_condition;
+
+	void try_input();
+	void input(token *tok);
+	void process(token *tok, bool holding);
+	void finish(token *tok);
+};
+
+ago_pipeline::ago_pipeline()
+	: impl(new pipeline_impl)
+{
+	impl->pool = nullptr;
+	impl->input_busy = false;
+	impl->input_done = true;
+	impl->next_seq = 0;
+	impl->running = false;
+}
+
+/* A pipeline may not be destroyed while it runs, so wait for it. */
+ago_pipeline::~ago_pipeline()
+{
+	wait();
+}
+
+void ago_pipeline::add_filter(mode m, std::function<void*(void*)> func)
+{
+	if(impl->filters.empty()) m = serial_in_order;
+	impl->filters.emplace_back(m, std::move(func));
+}
+
+void ago_pipeline::run(ago &pool, std::size_t max_tokens)
+{
+	/* only one run at a time */
+	wait();
+
+	if(impl->filters.empty() || max_tokens == 0) return;
+
+	impl->pool = &pool;
+	impl->tokens.resize(max_tokens);
+	impl->free_tokens.clear();
+	for(auto t = begin(impl->tokens); t != end(impl->tokens); ++t)
+	{
+		impl->free_tokens.push_back(&*t);
+	}
+	for(auto f = begin(impl->filters); f != end(impl->filters); ++f)
+	{
+		f->busy = false;
+		f->next_seq = 0;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(impl->pipe_mutex);
+		impl->input_busy = false;
+		impl->input_done = false;
+		impl->next_seq = 0;
+		impl->running = true;
+	}
+
+	impl->try_input();
+}
+
+void ago_pipeline::wait()
+{
+	std::unique_lock<std::mutex> lock(impl->pipe_mutex);
+	impl->done_condition.wait(lock, [&]{ return !impl->running; });
+}
+
+/* call the input filter if it is idle and a token is free */
+void ago_pipeline::pipeline_impl::try_input()
+{
+	token *tok = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(pipe_mutex);
+		if(!input_done && !input_busy && !free_tokens.empty())
+		{
+			input_busy = true;
+			tok = free_tokens.back();
+			free_tokens.pop_back();
+		}
+	}
+
+	if(tok)
+	{
+		pool->go([this, tok]{ input(tok); });
+	}
+}
+
+void ago_pipeline::pipeline_impl::input(token *tok)
+{
+	void *item = filters.front().func(nullptr);
+
+	{
+		std::lock_guard<std::mutex> lock(pipe_mutex);
+		input_busy = false;
+		if(!item)
+		{
+			input_done = true;
+		}
+		else
+		{
+			tok->seq = next_seq++;
+		}
+	}
+
+	if(!item)
+	{
+		finish(tok);
+		return;
+	}
+
+	/* let the next item in while this one moves on */
+	try_input();
+
+	tok->item = item;
+	tok->stage = 1;
+	process(tok, false);
+}
+
+/* Carry tok through the remaining filters. holding is set when the
+ * filter at tok->stage was already marked busy for us. */
+void ago_pipeline::pipeline_impl::process(token *tok, bool holding)
+{
+	for(; tok->stage < filters.size(); ++tok->stage, holding = false)
+	{
+		filter &f = filters[tok->stage];
+
+		if(f.m == parallel)
+		{
+			tok->item = f.func(tok->item);
+			continue;
+		}
+
+		if(!holding)
+		{
+			std::lock_guard<std::mutex> lock(f.filter_mutex);
+			if(f.m == serial_in_order)
+			{
+				if(f.busy || tok->seq != f.next_seq)
+				{
+					f.in_order_list[tok->seq] = tok;
+					return;
+				}
+			}
+			else if(f.busy)
+			{
+				f.out_of_order_list.push_back(tok);
+				return;
+			}
+			f.busy = true;
+		}
+
+		tok->item = f.func(tok->item);
+
+		/* leave the filter, handing it to a parked token if one may go */
+		token *next = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(f.filter_mutex);
+			if(f.m == serial_in_order)
+			{
+				++f.next_seq;
+				auto n = f.in_order_list.find(f.next_seq);
+				if(n != f.in_order_list.end())
+				{
+					next = n->second;
+					f.in_order_list.erase(n);
+				}
+			}
+			else if(!f.out_of_order_list.empty())
+			{
+				next = f.out_of_order_list.front();
+				f.out_of_order_list.pop_front();
+			}
+			f.busy = (next != nullptr);
+		}
+
+		if(next)
+		{
+			pool->go([this, next]{ process(next, true); });
+		}
+	}
+
+	finish(tok);
+}
+
+/* return tok, ending the run if it was the last one out */
+void ago_pipeline::pipeline_impl::finish(token *tok)
+{
+	bool done = false;
+	{
+		std::lock_guard<std::mutex> lock(pipe_mutex);
+		free_tokens.push_back(tok);
+		if(input_done && free_tokens.size() == tokens.size())
+		{
+			running = false;
+			done = true;
+			done_condition.notify_all();
+		}
+	}
+
+	if(!done)
+	{
+		try_input();
+	}
+}
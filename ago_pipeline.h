@@ -0,0 +1,46 @@
+#ifndef AGO_PIPELINE_H
+#define AGO_PIPELINE_H
+
+#include <memory>
+#include <functional>
+#include <cstddef>
+
+#include "ago.h"
+
+/* A chain of filters that items flow through, run on an ago pool.
+ * Different items can be in different filters at the same time, so the
+ * stages overlap instead of running as batches separated by waits.
+ * At most max_tokens items are in flight at once, which bounds memory.
+ */
+class ago_pipeline
+{
+public:
+	enum mode
+	{
+		serial_in_order,	/* one item at a time, in input order */
+		serial_out_of_order,	/* one item at a time, any order */
+		parallel		/* any number of items at once */
+	};
+
+	ago_pipeline();
+	virtual ~ago_pipeline();
+
+	/* Append a filter. Each filter is given the item returned by the one
+	 * before it. The first filter is the input: it is called with nullptr
+	 * and returns a new item each time, or nullptr when there are no
+	 * more. The input always runs as serial_in_order. */
+	void add_filter(mode m, std::function<void*(void*)> func);
+
+	/* start running the pipeline on pool and return immediately */
+	void run(ago &pool, std::size_t max_tokens);
+
+	/* wait until the input is exhausted and every item has passed
+	 * through the last filter */
+	void wait();
+
+private:
+	struct pipeline_impl;
+	std::shared_ptr<pipeline_impl> impl;
+};
+
+#endif	/* AGO_PIPELINE_H */
@@ -0,0 +1,532 @@
+/* functions run in child processes for ago */
+
+/* One shared anonymous mapping, made before forking, holds a header and
+ * a channel per child: a ring of requests from the parent and a ring of
+ * results back, each of fixed size slots. Both rings have one producer
+ * and one consumer, so they need only atomic head and tail indices; the
+ * parent side producer is serialized by the parent's mutex.
+ *
+ * A child spins briefly on an empty request ring and then sleeps on a
+ * futex on its tail, having set a flag the parent checks after
+ * publishing, so a busy child costs the parent no system call. Results
+ * work the same way in the other direction, except that all children
+ * share one counter the parent's reaper thread sleeps on. The reaper
+ * also wakes every 50ms to notice children that died, with waitpid().
+ *
+ * A child moves its request head past a call only after publishing the
+ * result, so when a child dies the request at its head is the one it
+ * was running, unless its result already arrived. That call fails, the
+ * head is moved past it, and a new child is forked on the same channel
+ * to carry on with the rest. Calls that find every ring full wait in a
+ * backlog that the reaper drains as results come in. The destructor
+ * stops the children with a request no function answers to.
+ *
+ * If fork() fails, the calls in that child's ring fail, the slot gets no
+ * more calls, and the reaper forks again on its next round. Calls left
+ * in the backlog while no child is running fail as well.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ago_process.h"
+
+namespace
+{
+	const std::size_t cache_line = 64;
+
+	/* the function number that tells a child to exit */
+	const std::uint32_t quit_func = 0xffffffff;
+
+	/* how often the reaper looks for dead children */
+	const long reap_interval_ns = 50000000;
+
+	/* spins on an empty ring before sleeping */
+	const int spin_limit = 2000;
+
+	struct ring
+	{
+		std::atomic<std::uint32_t> head;	/* written by the consumer */
+		char pad_head[cache_line - sizeof(std::uint32_t)];
+		std::atomic<std::uint32_t> tail;	/* written by the producer */
+		std::atomic<std::uint32_t> waiting;	/* the consumer sleeps on tail */
+		char pad_tail[cache_line - 2 * sizeof(std::uint32_t)];
+	};
+
+	struct channel
+	{
+		ring requests;
+		ring results;
+	};
+
+	struct shared_header
+	{
+		std::atomic<std::uint32_t> results;	/* bumped after every result */
+		std::atomic<std::uint32_t> waiting;	/* the parent sleeps on results */
+		char pad[cache_line - 2 * sizeof(std::uint32_t)];
+	};
+
+	/* at the start of each slot, followed by len bytes */
+	struct message
+	{
+		std::uint64_t id;
+		std::uint32_t func;	/* in a result, 1 if it succeeded */
+		std::uint32_t len;
+	};
+
+	std::uint32_t *word(std::atomic<std::uint32_t> &a)
+	{
+		return reinterpret_cast<std::uint32_t*>(&a);
+	}
+
+	void futex_wait(std::atomic<std::uint32_t> &a, std::uint32_t expected, const timespec *timeout)
+	{
+		syscall(SYS_futex, word(a), FUTEX_WAIT, expected, timeout, nullptr, 0);
+	}
+
+	void futex_wake(std::atomic<std::uint32_t> &a)
+	{
+		syscall(SYS_futex, word(a), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+	}
+
+	std::size_t round_up(std::size_t n, std::size_t to)
+	{
+		return (n + to - 1) / to * to;
+	}
+
+	/* a call's outcome, to give to the pool */
+	struct outcome
+	{
+		std::function<void(bool, std::string)> done;
+		bool ok;
+		std::string result;
+
+		void operator()() { done(ok, result); }
+	};
+}
+
+struct ago_process_pool::process_impl
+{
+	ago *pool;
+	std::vector<func> funcs;
+	std::size_t max_message;
+	std::size_t slot_size;
+	std::uint32_t queue;
+
+	void *memory;
+	std::size_t memory_size;
+	shared_header *header;
+
+	struct child
+	{
+		pid_t pid;
+		channel *chan;
+		char *requests;
+		char *results;
+		std::uint32_t outstanding;	/* sent and not yet answered */
+	};
+	std::vector<child> children;
+
+	/* a call waiting for room in a ring */
+	struct waiting_call
+	{
+		std::uint64_t id;
+		std::uint32_t func;
+		std::string arg;
+	};
+
+	/* the parent's side of everything, under m */
+	std::mutex m;
+	std::condition_variable idle_condition;
+	std::uint64_t next_id;
+	std::unordered_map<std::uint64_t, std::function<void(bool, std::string)>> calls;
+	std::deque<waiting_call> backlog;
+	bool quit;
+
+	std::atomic<int> restarts;
+	std::thread *reaper;
+
+	message *slot(char *slots, std::uint32_t index)
+	{
+		return reinterpret_cast<message*>(slots + (index & (queue - 1)) * slot_size);
+	}
+
+	void start_child(std::size_t i, std::vector<outcome> &done);
+	void fail_requests(child &c, std::vector<outcome> &done);
+	void child_main(child &c);
+	bool send(child &c, std::uint64_t id, std::uint32_t f, const std::string &arg);
+	bool send_any(std::uint64_t id, std::uint32_t f, const std::string &arg);
+	void collect(child &c, std::vector<outcome> &done);
+	void replace(std::size_t i, std::vector<outcome> &done);
+	void reap_loop();
+};
+
+/* called with m held, or before the reaper starts; a pid of -1 marks a
+ * slot whose fork() failed */
+void ago_process_pool::process_impl::start_child(std::size_t i, std::vector<outcome> &done)
+{
+	pid_t parent = getpid();
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		/* die with the parent */
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		if(getppid() != parent) _exit(0);
+		child_main(children[i]);
+	}
+	children[i].pid = pid;
+	if(pid < 0) fail_requests(children[i], done);
+}
+
+/* nothing will run the calls in c's ring; called with m held */
+void ago_process_pool::process_impl::fail_requests(child &c, std::vector<outcome> &done)
+{
+	ring &r = c.chan->requests;
+	std::uint32_t head = r.head.load(std::memory_order_relaxed);
+	std::uint32_t tail = r.tail.load(std::memory_order_relaxed);
+	for(; head != tail; ++head)
+	{
+		const message *msg = slot(c.requests, head);
+		auto call = calls.find(msg->id);
+		if(call != calls.end())
+		{
+			outcome o = { std::move(call->second), false, std::string() };
+			done.push_back(std::move(o));
+			calls.erase(call);
+		}
+		--c.outstanding;
+	}
+	r.head.store(head, std::memory_order_release);
+	r.waiting.store(0, std::memory_order_relaxed);
+}
+
+/* the whole life of a child process */
+void ago_process_pool::process_impl::child_main(child &c)
+{
+	ring &requests = c.chan->requests;
+	ring &results = c.chan->results;
+	std::uint32_t head = requests.head.load(std::memory_order_relaxed);
+
+	while(1)
+	{
+		int spins = 0;
+		while(requests.tail.load(std::memory_order_acquire) == head)
+		{
+			if(++spins < spin_limit) continue;
+			requests.waiting.store(1, std::memory_order_seq_cst);
+			if(requests.tail.load(std::memory_order_seq_cst) == head)
+			{
+				futex_wait(requests.tail, head, nullptr);
+			}
+			requests.waiting.store(0, std::memory_order_relaxed);
+		}
+
+		const message *in = slot(c.requests, head);
+		if(in->func == quit_func) _exit(0);
+
+		bool ok = true;
+		std::string result;
+		try
+		{
+			result = funcs[in->func](std::string((const char*)(in + 1), in->len));
+		}
+		catch(...)
+		{
+			ok = false;
+		}
+		if(result.size() > max_message)
+		{
+			ok = false;
+			result.clear();
+		}
+
+		/* wait for the parent to make room, which is rare */
+		std::uint32_t tail = results.tail.load(std::memory_order_relaxed);
+		while(tail - results.head.load(std::memory_order_acquire) == queue)
+		{
+			usleep(50);
+		}
+
+		message *out = slot(c.results, tail);
+		out->id = in->id;
+		out->func = ok ? 1 : 0;
+		out->len = (std::uint32_t)result.size();
+		std::memcpy(out + 1, result.data(), result.size());
+		results.tail.store(tail + 1, std::memory_order_release);
+
+		/* only now is the call finished as far as a replacement knows */
+		requests.head.store(++head, std::memory_order_release);
+
+		header->results.fetch_add(1, std::memory_order_seq_cst);
+		if(header->waiting.load(std::memory_order_seq_cst)) futex_wake(header->results);
+	}
+}
+
+/* Put a request in the child's ring, if there is room. Called with m
+ * held, so the parent is a single producer. */
+bool ago_process_pool::process_impl::send(child &c, std::uint64_t id, std::uint32_t f,
+	const std::string &arg)
+{
+	ring &r = c.chan->requests;
+	std::uint32_t tail = r.tail.load(std::memory_order_relaxed);
+	if(tail - r.head.load(std::memory_order_acquire) == queue) return false;
+
+	message *msg = slot(c.requests, tail);
+	msg->id = id;
+	msg->func = f;
+	msg->len = (std::uint32_t)arg.size();
+	std::memcpy(msg + 1, arg.data(), arg.size());
+	r.tail.store(tail + 1, std::memory_order_seq_cst);
+
+	if(r.waiting.load(std::memory_order_seq_cst))
+	{
+		r.waiting.store(0, std::memory_order_relaxed);
+		futex_wake(r.tail);
+	}
+	++c.outstanding;
+	return true;
+}
+
+/* send to the least busy child with room */
+bool ago_process_pool::process_impl::send_any(std::uint64_t id, std::uint32_t f,
+	const std::string &arg)
+{
+	std::vector<child*> order;
+	for(auto c = children.begin(); c != children.end(); ++c)
+	{
+		if(c->pid > 0) order.push_back(&*c);
+	}
+	std::sort(order.begin(), order.end(),
+		[](const child *a, const child *b){ return a->outstanding < b->outstanding; });
+
+	for(auto c = order.begin(); c != order.end(); ++c)
+	{
+		if(send(**c, id, f, arg)) return true;
+	}
+	return false;
+}
+
+/* take the child's results; called with m held */
+void ago_process_pool::process_impl::collect(child &c, std::vector<outcome> &done)
+{
+	ring &r = c.chan->results;
+	std::uint32_t head = r.head.load(std::memory_order_relaxed);
+	std::uint32_t tail = r.tail.load(std::memory_order_acquire);
+	for(; head != tail; ++head)
+	{
+		const message *msg = slot(c.results, head);
+		auto call = calls.find(msg->id);
+		if(call != calls.end())
+		{
+			outcome o = { std::move(call->second), msg->func != 0,
+				std::string((const char*)(msg + 1), msg->len) };
+			done.push_back(std::move(o));
+			calls.erase(call);
+		}
+		--c.outstanding;
+	}
+	r.head.store(head, std::memory_order_release);
+}
+
+/* child i has died; called with m held */
+void ago_process_pool::process_impl::replace(std::size_t i, std::vector<outcome> &done)
+{
+	child &c = children[i];
+	collect(c, done);
+
+	/* the call at the head was running, unless it has been answered */
+	ring &r = c.chan->requests;
+	std::uint32_t head = r.head.load(std::memory_order_relaxed);
+	if(head != r.tail.load(std::memory_order_relaxed))
+	{
+		const message *msg = slot(c.requests, head);
+		auto call = calls.find(msg->id);
+		if(call != calls.end())
+		{
+			outcome o = { std::move(call->second), false, std::string() };
+			done.push_back(std::move(o));
+			calls.erase(call);
+			--c.outstanding;
+		}
+		r.head.store(head + 1, std::memory_order_release);
+	}
+	r.waiting.store(0, std::memory_order_relaxed);
+
+	++restarts;
+	start_child(i, done);
+}
+
+void ago_process_pool::process_impl::reap_loop()
+{
+	while(1)
+	{
+		std::uint32_t seen = header->results.load(std::memory_order_acquire);
+		std::vector<outcome> done;
+		{
+			std::lock_guard<std::mutex> lock(m);
+			if(quit) return;
+
+			bool running = false;
+			for(std::size_t i = 0; i < children.size(); ++i)
+			{
+				/* waitpid() of -1 would reap the program's own children */
+				if(children[i].pid < 0) start_child(i, done);
+				if(children[i].pid < 0) continue;
+
+				collect(children[i], done);
+				int status;
+				if(waitpid(children[i].pid, &status, WNOHANG) == children[i].pid)
+				{
+					replace(i, done);
+				}
+				if(children[i].pid > 0) running = true;
+			}
+
+			while(!backlog.empty() &&
+				send_any(backlog.front().id, backlog.front().func, backlog.front().arg))
+			{
+				backlog.pop_front();
+			}
+			for(; !running && !backlog.empty(); backlog.pop_front())
+			{
+				auto call = calls.find(backlog.front().id);
+				outcome o = { std::move(call->second), false, std::string() };
+				done.push_back(std::move(o));
+				calls.erase(call);
+			}
+			if(calls.empty()) idle_condition.notify_all();
+		}
+
+		for(auto d = done.begin(); d != done.end(); ++d)
+		{
+			pool->go(std::move(*d));
+		}
+
+		header->waiting.store(1, std::memory_order_seq_cst);
+		if(header->results.load(std::memory_order_seq_cst) == seen)
+		{
+			timespec timeout = { 0, reap_interval_ns };
+			futex_wait(header->results, seen, &timeout);
+		}
+		header->waiting.store(0, std::memory_order_relaxed);
+	}
+}
+
+ago_process_pool::ago_process_pool(ago &pool, const std::vector<func> &funcs, int processes,
+	std::size_t max_message, std::size_t queue)
+	: impl(new process_impl)
+{
+	/* with no child nothing would serve calls, and the destructor would
+	 * wait for them forever */
+	if(processes < 1) processes = 1;
+
+	impl->pool = &pool;
+	impl->funcs = funcs;
+	impl->max_message = max_message;
+	impl->slot_size = round_up(sizeof(message) + max_message, cache_line);
+	impl->queue = 1;
+	while(impl->queue < queue) impl->queue *= 2;
+	impl->next_id = 1;
+	impl->quit = false;
+	impl->restarts = 0;
+
+	std::size_t per_child = sizeof(channel) + 2 * impl->queue * impl->slot_size;
+	impl->memory_size = sizeof(shared_header) + processes * per_child;
+	impl->memory = mmap(nullptr, impl->memory_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(impl->memory == MAP_FAILED) throw std::bad_alloc();
+
+	/* a fresh mapping is zeroed, which is the initial state */
+	char *p = (char*)impl->memory;
+	impl->header = (shared_header*)p;
+	p += sizeof(shared_header);
+	for(int i = 0; i < processes; ++i)
+	{
+		process_impl::child c;
+		c.pid = -1;
+		c.chan = (channel*)p;
+		c.requests = p + sizeof(channel);
+		c.results = c.requests + impl->queue * impl->slot_size;
+		c.outstanding = 0;
+		impl->children.push_back(c);
+		p += per_child;
+	}
+
+	/* no call can be in a ring yet, so nothing fails here */
+	std::vector<outcome> done;
+	for(int i = 0; i < processes; ++i)
+	{
+		impl->start_child(i, done);
+	}
+	process_impl *pi = impl.get();
+	impl->reaper = new std::thread([pi]{ pi->reap_loop(); });
+}
+
+ago_process_pool::~ago_process_pool()
+{
+	std::unique_lock<std::mutex> lock(impl->m);
+	impl->idle_condition.wait(lock, [&]{ return impl->calls.empty(); });
+
+	/* the reaper must not replace children that exit now */
+	impl->quit = true;
+	for(auto c = impl->children.begin(); c != impl->children.end(); ++c)
+	{
+		if(c->pid > 0) impl->send(*c, 0, quit_func, std::string());
+	}
+	lock.unlock();
+
+	impl->header->results.fetch_add(1, std::memory_order_seq_cst);
+	futex_wake(impl->header->results);
+	impl->reaper->join();
+	delete impl->reaper;
+
+	for(auto c = impl->children.begin(); c != impl->children.end(); ++c)
+	{
+		int status;
+		if(c->pid > 0) waitpid(c->pid, &status, 0);
+	}
+	munmap(impl->memory, impl->memory_size);
+}
+
+void ago_process_pool::call(int id, const std::string &arg,
+	std::function<void(bool, std::string)> done)
+{
+	if(id < 0 || id >= (int)impl->funcs.size() || arg.size() > impl->max_message)
+	{
+		outcome o = { std::move(done), false, std::string() };
+		impl->pool->go(std::move(o));
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(impl->m);
+	std::uint64_t call_id = impl->next_id++;
+	impl->calls[call_id] = std::move(done);
+	if(!impl->send_any(call_id, (std::uint32_t)id, arg))
+	{
+		process_impl::waiting_call w = { call_id, (std::uint32_t)id, arg };
+		impl->backlog.push_back(std::move(w));
+	}
+}
+
+int ago_process_pool::restarts() const
+{
+	return impl->restarts.load();
+}
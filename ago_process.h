@@ -0,0 +1,57 @@
+#ifndef AGO_PROCESS_H
+#define AGO_PROCESS_H
+
+#include <memory>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include "ago.h"
+
+/* Functions run in forked child processes, so a crash takes down only
+ * the child. (Linux only.)
+ *
+ * The functions are given to the constructor, which forks the children,
+ * and are called by number with a string of bytes as their argument,
+ * returning another. Requests and results pass through rings in shared
+ * memory, so a call makes no system call unless the other side is
+ * asleep. A child that dies is replaced; the call it was running fails
+ * and the ones queued behind it carry on in the new child. If a child
+ * cannot be forked, the calls queued for it fail and it is tried again
+ * a little later.
+ *
+ * Children are forked from a process that has threads, so the functions
+ * may only rely on what was set up before the ago_process_pool was
+ * constructed.
+ */
+class ago_process_pool
+{
+public:
+	typedef std::string (*func)(const std::string &arg);
+
+	/* processes: children to fork, at least 1. max_message: longest
+	 * argument or result. queue: calls each child can have waiting. */
+	ago_process_pool(ago &pool, const std::vector<func> &funcs, int processes,
+		std::size_t max_message = 4096, std::size_t queue = 64);
+
+	/* waits for calls in progress, then stops the children */
+	virtual ~ago_process_pool();
+
+	/* Call funcs[id](arg) in a child. done(ok, result) is given to
+	 * ago::go(); ok is false if the child died during the call or the
+	 * argument or result was longer than max_message. */
+	void call(int id, const std::string &arg, std::function<void(bool, std::string)> done);
+
+	/* children replaced after dying, so far */
+	int restarts() const;
+
+private:
+	ago_process_pool(const ago_process_pool &);
+	ago_process_pool &operator=(const ago_process_pool &);
+
+	struct process_impl;
+	std::shared_ptr<process_impl> impl;
+};
+
+#endif	/* AGO_PROCESS_H */
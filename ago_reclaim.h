@@ -0,0 +1,332 @@
+#ifndef AGO_RECLAIM_H
+#define AGO_RECLAIM_H
+
+/* Memory reclamation for lock-free structures used by the threads of an
+ * ago pool.
+ *
+ * A lock-free structure cannot delete a node it has unlinked while
+ * another thread may still be reading it. It hands the node to retire()
+ * instead, and reads the structure only inside a guard, reading its
+ * links with guard::protect(). A retired node is deleted once no guard
+ * can still see it.
+ *
+ * Threads of the pool use epochs. A guard marks its thread as reading
+ * with one store and fence to the thread's own slot; retire() tags the
+ * node with the global epoch, which only moves on once every thread
+ * inside a guard has seen its current value, so a node is safe two
+ * epochs after it was retired. Each thread keeps what it retires in a
+ * list of its own and frees from it every batch nodes. Whenever a thread
+ * runs out of work it holds no guard, so there it moves the epoch on and
+ * frees what it can, and most reclaiming is done while the pool has
+ * nothing better to do. A guard held for long stops reclaiming, so do not
+ * block inside one.
+ *
+ * Other threads use hazard pointers: their guard takes a record from a
+ * list shared by the domain, and protect() publishes each pointer it
+ * returns there. Nodes they retire go to a shared list. A node is only
+ * deleted when no hazard record holds it either. On threads of the pool
+ * protect() is a plain acquire load, so one code path serves both.
+ *
+ * The ago_reclaim must outlive the structures using it and be destroyed
+ * before the ago object. It deletes whatever is still retired.
+ *
+ * ago_reclaim serves ago; basic_ago_reclaim<Pool> serves a basic_ago
+ * with other policies.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "ago.h"
+
+template<class Pool = ago>
+class basic_ago_reclaim
+{
+	struct hazard_record;
+
+public:
+	/* pointers a guard off the pool can protect at once */
+	static const int hazards = 4;
+
+	explicit basic_ago_reclaim(Pool &pool, std::size_t batch = 64)
+		: pool(pool), batch(batch), epoch(0), slots(pool.worker_slots()), records(nullptr)
+	{
+		hook = pool.add_idle_hook([this](int index){ quiesce(index); });
+	}
+
+	~basic_ago_reclaim()
+	{
+		pool.remove_idle_hook(hook);
+		for(auto s = slots.begin(); s != slots.end(); ++s)
+		{
+			free_all(s->limbo);
+		}
+		free_all(shared);
+
+		for(hazard_record *r = records.load(); r; )
+		{
+			hazard_record *next = r->next;
+			delete r;
+			r = next;
+		}
+	}
+
+	/* Held around every access to a structure. Guards may nest. */
+	class guard
+	{
+	public:
+		explicit guard(basic_ago_reclaim &domain)
+			: domain(domain), index(domain.pool.worker_index()), record(nullptr)
+		{
+			if(index >= 0) domain.pin(index);
+			else record = domain.acquire_record();
+		}
+
+		~guard()
+		{
+			if(index >= 0) domain.unpin(index);
+			else domain.release_record(record);
+		}
+
+		/* Read src. What it returns stays valid until the guard ends, or
+		 * off the pool until protect() is called again with the same
+		 * slot, in [0, hazards). */
+		template<class T>
+		T *protect(const std::atomic<T*> &src, int slot = 0)
+		{
+			if(!record) return src.load(std::memory_order_acquire);
+
+			T *p = src.load(std::memory_order_relaxed);
+			for(;;)
+			{
+				record->ptr[slot].store(p);
+				T *again = src.load(std::memory_order_acquire);
+				if(again == p) return p;
+				p = again;
+			}
+		}
+
+	private:
+		guard(const guard &);
+		guard &operator=(const guard &);
+
+		basic_ago_reclaim &domain;
+		int index;
+		hazard_record *record;
+	};
+
+	/* delete p once no guard can see it; it must be unlinked already */
+	template<class T>
+	void retire(T *p)
+	{
+		retire(p, [](void *q){ delete static_cast<T*>(q); });
+	}
+
+	void retire(void *p, void (*deleter)(void *))
+	{
+		retired r = { p, deleter, epoch.load() };
+		int index = pool.worker_index();
+		if(index >= 0)
+		{
+			std::vector<retired> &own = slots[index].limbo;
+			own.push_back(r);
+			if(own.size() >= batch)
+			{
+				try_advance();
+				collect(own);
+			}
+			return;
+		}
+
+		std::vector<retired> full;
+		{
+			std::lock_guard<std::mutex> lock(shared_mutex);
+			shared.push_back(r);
+			if(shared.size() < batch) return;
+			full.swap(shared);
+		}
+		try_advance();
+		collect_shared(full);
+	}
+
+private:
+	basic_ago_reclaim(const basic_ago_reclaim &);
+	basic_ago_reclaim &operator=(const basic_ago_reclaim &);
+
+	struct retired
+	{
+		void *p;
+		void (*deleter)(void *);
+		std::uint64_t epoch;
+	};
+
+	struct hazard_record
+	{
+		hazard_record() : used(true), next(nullptr)
+		{
+			for(int i = 0; i < hazards; ++i) ptr[i].store(nullptr, std::memory_order_relaxed);
+		}
+
+		std::atomic<bool> used;
+		std::atomic<void*> ptr[hazards];
+		hazard_record *next;
+	};
+
+	struct slot
+	{
+		slot() : state(0), depth(0) {}
+
+		/* keep neighbouring slots off each other's cache lines */
+		char pad_before[64];
+		std::atomic<std::uint64_t> state;	/* epoch seen << 1, | 1 inside a guard */
+		int depth;				/* guards held; only the owner uses it */
+		std::vector<retired> limbo;		/* retired here; only the owner uses it */
+		char pad_after[64];
+	};
+
+	void pin(int index)
+	{
+		slot &s = slots[index];
+		if(s.depth++) return;
+		s.state.store(epoch.load(std::memory_order_relaxed) << 1 | 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	void unpin(int index)
+	{
+		slot &s = slots[index];
+		if(--s.depth) return;
+		s.state.store(s.state.load(std::memory_order_relaxed) & ~std::uint64_t(1),
+			std::memory_order_release);
+	}
+
+	hazard_record *acquire_record()
+	{
+		for(hazard_record *r = records.load(std::memory_order_acquire); r; r = r->next)
+		{
+			bool free = false;
+			if(!r->used.load(std::memory_order_relaxed) &&
+				r->used.compare_exchange_strong(free, true, std::memory_order_acquire))
+			{
+				return r;
+			}
+		}
+
+		hazard_record *r = new hazard_record;
+		r->next = records.load(std::memory_order_relaxed);
+		while(!records.compare_exchange_weak(r->next, r, std::memory_order_release,
+			std::memory_order_relaxed))
+		{
+		}
+		return r;
+	}
+
+	void release_record(hazard_record *r)
+	{
+		for(int i = 0; i < hazards; ++i) r->ptr[i].store(nullptr, std::memory_order_release);
+		r->used.store(false, std::memory_order_release);
+	}
+
+	/* move the epoch on if every thread inside a guard has seen it */
+	void try_advance()
+	{
+		std::uint64_t e = epoch.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		for(auto s = slots.begin(); s != slots.end(); ++s)
+		{
+			std::uint64_t state = s->state.load(std::memory_order_acquire);
+			if((state & 1) && state >> 1 != e) return;
+		}
+		epoch.compare_exchange_strong(e, e + 1, std::memory_order_release,
+			std::memory_order_relaxed);
+	}
+
+	/* delete what in list is safe, keeping the rest in it */
+	void collect(std::vector<retired> &list)
+	{
+		std::vector<retired> todo;
+		todo.swap(list);
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::uint64_t e = epoch.load(std::memory_order_acquire);
+		std::vector<void*> hazarded;
+		for(hazard_record *r = records.load(std::memory_order_acquire); r; r = r->next)
+		{
+			for(int i = 0; i < hazards; ++i)
+			{
+				void *p = r->ptr[i].load(std::memory_order_acquire);
+				if(p) hazarded.push_back(p);
+			}
+		}
+		std::sort(hazarded.begin(), hazarded.end());
+
+		/* deleters may retire more, into list */
+		for(auto r = todo.begin(); r != todo.end(); ++r)
+		{
+			if(r->epoch + 2 <= e && !std::binary_search(hazarded.begin(), hazarded.end(), r->p))
+			{
+				r->deleter(r->p);
+			}
+			else
+			{
+				list.push_back(*r);
+			}
+		}
+	}
+
+	/* collect() for nodes taken from the shared list, returning the rest */
+	void collect_shared(std::vector<retired> &list)
+	{
+		collect(list);
+		if(list.empty()) return;
+		std::lock_guard<std::mutex> lock(shared_mutex);
+		shared.insert(shared.end(), list.begin(), list.end());
+	}
+
+	/* called by thread index as it runs out of work, holding no guard;
+	 * with no other thread inside one, two advances make everything
+	 * retired so far safe */
+	void quiesce(int index)
+	{
+		try_advance();
+		try_advance();
+		collect(slots[index].limbo);
+
+		std::vector<retired> list;
+		{
+			std::lock_guard<std::mutex> lock(shared_mutex);
+			list.swap(shared);
+		}
+		if(!list.empty()) collect_shared(list);
+	}
+
+	static void free_all(std::vector<retired> &list)
+	{
+		/* deleters may retire more, into list */
+		while(!list.empty())
+		{
+			retired r = list.back();
+			list.pop_back();
+			r.deleter(r.p);
+		}
+	}
+
+	Pool &pool;
+	std::size_t batch;
+	std::atomic<std::uint64_t> epoch;
+	std::vector<slot> slots;
+	std::atomic<hazard_record*> records;
+
+	std::mutex shared_mutex;
+	std::vector<retired> shared;
+
+	int hook;
+};
+
+typedef basic_ago_reclaim<> ago_reclaim;
+
+#endif	/* AGO_RECLAIM_H */
@@ -0,0 +1,825 @@
+/* calls by name between ago pools */
+
+/* A frame is any number of messages one after another. A request is a
+ * kind byte, a call id, the name and the argument; a result is a kind
+ * byte saying whether it succeeded, the id of the call, and the result or
+ * the reason it failed. Integers are little endian, and strings are
+ * preceded by a 32 bit length.
+ *
+ * Each peer has a string of messages waiting to be sent. A function
+ * running on the pool appends to it and registers with ago::at_return()
+ * to send it when it returns, so everything it calls goes out together.
+ * Whoever sends takes the whole string as one frame, and anything added
+ * while that frame is going out is sent by the same thread straight after,
+ * so threads never wait on each other's sends and frames grow under load.
+ *
+ * Requests are handled on the pool, one function each, and their results
+ * are sent the same way. Results are matched to calls by id; a call is
+ * resolved on the transport's thread if it has a future, and otherwise
+ * its done function is given to ago::go().
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "ago_remote.h"
+
+namespace
+{
+	enum message_kind
+	{
+		request,
+		result_ok,
+		result_failed
+	};
+
+	/* a frame held for a pool function is sent early past this size */
+	const std::size_t batch_limit = 64 * 1024;
+
+	void put_u32(std::string &out, std::uint32_t v)
+	{
+		char b[4];
+		for(int i = 0; i < 4; ++i) b[i] = (char)(v >> (8 * i));
+		out.append(b, 4);
+	}
+
+	void put_u64(std::string &out, std::uint64_t v)
+	{
+		char b[8];
+		for(int i = 0; i < 8; ++i) b[i] = (char)(v >> (8 * i));
+		out.append(b, 8);
+	}
+
+	void put_bytes(std::string &out, const std::string &s)
+	{
+		put_u32(out, (std::uint32_t)s.size());
+		out.append(s);
+	}
+
+	std::uint32_t get_u32(const char *b)
+	{
+		std::uint32_t v = 0;
+		for(int i = 0; i < 4; ++i) v |= (std::uint32_t)(unsigned char)b[i] << (8 * i);
+		return v;
+	}
+
+	/* takes messages apart, noting if one runs past the end of the frame */
+	struct frame_reader
+	{
+		explicit frame_reader(const std::string &frame) : frame(frame), at(0), ok(true) {}
+
+		std::uint64_t get(std::size_t bytes)
+		{
+			if(!ok || frame.size() - at < bytes)
+			{
+				ok = false;
+				return 0;
+			}
+			std::uint64_t v = 0;
+			for(std::size_t i = 0; i < bytes; ++i)
+			{
+				v |= (std::uint64_t)(unsigned char)frame[at + i] << (8 * i);
+			}
+			at += bytes;
+			return v;
+		}
+
+		std::string bytes()
+		{
+			std::size_t n = (std::size_t)get(4);
+			if(!ok || frame.size() - at < n)
+			{
+				ok = false;
+				return std::string();
+			}
+			std::string s(frame, at, n);
+			at += n;
+			return s;
+		}
+
+		bool done() const { return !ok || at == frame.size(); }
+
+		const std::string &frame;
+		std::size_t at;
+		bool ok;
+	};
+
+	/* a call's outcome, to give to the pool */
+	struct outcome
+	{
+		std::function<void(bool, std::string)> done;
+		bool ok;
+		std::string result;
+
+		void operator()() { done(ok, result); }
+	};
+}
+
+struct ago_loopback_transport::loopback_impl
+{
+	/* what the two ends share */
+	struct link
+	{
+		link() : closed(false) {}
+
+		std::mutex m;
+		std::condition_variable condition;
+		std::deque<std::string> frames[2];	/* waiting for each end */
+		bool closed;
+	};
+
+	std::shared_ptr<link> shared;
+	int side;
+	std::function<void(std::string &)> receive;
+	std::function<void()> closed;
+	std::thread *thread;
+
+	void deliver();
+};
+
+void ago_loopback_transport::loopback_impl::deliver()
+{
+	std::deque<std::string> &frames = shared->frames[side];
+	std::unique_lock<std::mutex> lock(shared->m);
+	while(1)
+	{
+		shared->condition.wait(lock, [&]{ return !frames.empty() || shared->closed; });
+		if(frames.empty()) break;
+
+		std::string frame = std::move(frames.front());
+		frames.pop_front();
+		lock.unlock();
+		receive(frame);
+		lock.lock();
+	}
+	lock.unlock();
+	closed();
+}
+
+ago_loopback_transport::ago_loopback_transport()
+	: impl(new loopback_impl)
+{
+	impl->side = 0;
+	impl->thread = nullptr;
+}
+
+std::pair<std::shared_ptr<ago_transport>, std::shared_ptr<ago_transport>>
+	ago_loopback_transport::pair()
+{
+	std::shared_ptr<loopback_impl::link> l(new loopback_impl::link);
+	ago_loopback_transport *a = new ago_loopback_transport;
+	ago_loopback_transport *b = new ago_loopback_transport;
+	a->impl->shared = l;
+	b->impl->shared = l;
+	b->impl->side = 1;
+	return std::make_pair(std::shared_ptr<ago_transport>(a), std::shared_ptr<ago_transport>(b));
+}
+
+ago_loopback_transport::~ago_loopback_transport()
+{
+	close();
+
+	/* destroyed from its own callback; the thread holds impl until it ends */
+	if(impl->thread)
+	{
+		impl->thread->detach();
+		delete impl->thread;
+	}
+}
+
+void ago_loopback_transport::start(std::function<void(std::string &frame)> receive,
+	std::function<void()> closed)
+{
+	impl->receive = std::move(receive);
+	impl->closed = std::move(closed);
+	std::shared_ptr<loopback_impl> l = impl;
+	impl->thread = new std::thread([l]{ l->deliver(); });
+}
+
+void ago_loopback_transport::send(const std::string &frame)
+{
+	std::lock_guard<std::mutex> lock(impl->shared->m);
+	if(impl->shared->closed) return;
+	impl->shared->frames[1 - impl->side].push_back(frame);
+	impl->shared->condition.notify_all();
+}
+
+void ago_loopback_transport::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(impl->shared->m);
+		impl->shared->closed = true;
+		impl->shared->condition.notify_all();
+	}
+	if(impl->thread && impl->thread->get_id() != std::this_thread::get_id())
+	{
+		impl->thread->join();
+		delete impl->thread;
+		impl->thread = nullptr;
+	}
+}
+
+#ifndef _WIN32
+
+namespace
+{
+	bool read_full(int fd, char *p, std::size_t n)
+	{
+		while(n)
+		{
+			ssize_t r = ::recv(fd, p, n, 0);
+			if(r < 0 && errno == EINTR) continue;
+			if(r <= 0) return false;
+			p += r;
+			n -= (std::size_t)r;
+		}
+		return true;
+	}
+
+	bool write_full(int fd, const char *p, std::size_t n, int flags)
+	{
+		while(n)
+		{
+			ssize_t r = ::send(fd, p, n, MSG_NOSIGNAL | flags);
+			if(r < 0 && errno == EINTR) continue;
+			if(r < 0) return false;
+			p += r;
+			n -= (std::size_t)r;
+		}
+		return true;
+	}
+}
+
+struct ago_tcp_transport::tcp_impl
+{
+	~tcp_impl() { ::close(fd); }
+
+	int fd;
+	std::uint32_t max_frame;	/* a longer frame ends the connection */
+	std::atomic<bool> ended;
+	std::mutex send_mutex;
+	std::function<void(std::string &)> receive;
+	std::function<void()> closed;
+	std::thread *thread;
+
+	void read_loop();
+};
+
+void ago_tcp_transport::tcp_impl::read_loop()
+{
+	while(1)
+	{
+		char header[4];
+		if(!read_full(fd, header, sizeof(header))) break;
+		std::uint32_t n = get_u32(header);
+		if(n > max_frame) break;
+
+		std::string frame(n, '\0');
+		if(n && !read_full(fd, &frame[0], n)) break;
+		receive(frame);
+	}
+	/* so that the peer hears of it too, when a frame was too long */
+	ended = true;
+	shutdown(fd, SHUT_RDWR);
+	closed();
+}
+
+const std::uint32_t ago_tcp_transport::default_max_frame;
+
+ago_tcp_transport::ago_tcp_transport(int fd, std::uint32_t max_frame)
+	: impl(new tcp_impl)
+{
+	impl->fd = fd;
+	impl->max_frame = max_frame;
+	impl->ended = false;
+	impl->thread = nullptr;
+
+	/* ago_remote does its own batching */
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+std::shared_ptr<ago_transport> ago_tcp_transport::connect(const std::string &host, int port,
+	std::uint32_t max_frame)
+{
+	addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *found;
+	if(getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0)
+	{
+		return std::shared_ptr<ago_transport>();
+	}
+
+	int fd = -1;
+	for(addrinfo *a = found; a && fd < 0; a = a->ai_next)
+	{
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) != 0)
+		{
+			::close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(found);
+	if(fd < 0) return std::shared_ptr<ago_transport>();
+	return std::make_shared<ago_tcp_transport>(fd, max_frame);
+}
+
+ago_tcp_transport::~ago_tcp_transport()
+{
+	close();
+	if(impl->thread)
+	{
+		impl->thread->detach();
+		delete impl->thread;
+	}
+}
+
+void ago_tcp_transport::start(std::function<void(std::string &frame)> receive,
+	std::function<void()> closed)
+{
+	impl->receive = std::move(receive);
+	impl->closed = std::move(closed);
+	std::shared_ptr<tcp_impl> t = impl;
+	impl->thread = new std::thread([t]{ t->read_loop(); });
+}
+
+void ago_tcp_transport::send(const std::string &frame)
+{
+	if(impl->ended) return;
+
+	char header[4];
+	for(int i = 0; i < 4; ++i) header[i] = (char)(frame.size() >> (8 * i));
+
+	std::lock_guard<std::mutex> lock(impl->send_mutex);
+	if(!write_full(impl->fd, header, sizeof(header), MSG_MORE) ||
+		!write_full(impl->fd, frame.data(), frame.size(), 0))
+	{
+		/* the reader finds out and ends the connection */
+		shutdown(impl->fd, SHUT_RDWR);
+	}
+}
+
+void ago_tcp_transport::close()
+{
+	impl->ended = true;
+	shutdown(impl->fd, SHUT_RDWR);
+	if(impl->thread && impl->thread->get_id() != std::this_thread::get_id())
+	{
+		impl->thread->join();
+		delete impl->thread;
+		impl->thread = nullptr;
+	}
+}
+
+ago_tcp_listener::ago_tcp_listener(int port, std::uint32_t max_frame)
+	: fd(-1), bound_port(-1), max_frame(max_frame)
+{
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0) return;
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short)port);
+	socklen_t len = sizeof(addr);
+	if(bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0 ||
+		getsockname(fd, (sockaddr*)&addr, &len) != 0)
+	{
+		::close(fd);
+		fd = -1;
+		return;
+	}
+	bound_port = ntohs(addr.sin_port);
+}
+
+ago_tcp_listener::~ago_tcp_listener()
+{
+	close();
+	if(fd >= 0) ::close(fd);
+}
+
+int ago_tcp_listener::port() const
+{
+	return bound_port;
+}
+
+std::shared_ptr<ago_transport> ago_tcp_listener::accept()
+{
+	while(fd >= 0)
+	{
+		int conn = ::accept(fd, nullptr, nullptr);
+		if(conn >= 0) return std::make_shared<ago_tcp_transport>(conn, max_frame);
+		if(errno != EINTR && errno != ECONNABORTED) break;
+	}
+	return std::shared_ptr<ago_transport>();
+}
+
+void ago_tcp_listener::close()
+{
+	/* wakes a thread waiting in accept() */
+	if(fd >= 0) shutdown(fd, SHUT_RDWR);
+}
+
+#endif	/* _WIN32 */
+
+struct ago_remote::remote_impl : std::enable_shared_from_this<ago_remote::remote_impl>
+{
+	ago *pool;
+
+	struct peer
+	{
+		peer() : sending(false), open(true), outstanding(0) {}
+
+		std::shared_ptr<ago_transport> transport;
+
+		/* messages not yet sent, under out_mutex */
+		std::mutex out_mutex;
+		std::string out;
+		bool sending;
+
+		/* under the impl's m */
+		bool open;
+		std::size_t outstanding;
+	};
+
+	struct pending_call
+	{
+		peer *to;
+		std::function<void(bool, std::string)> done;
+		std::shared_ptr<std::promise<std::string>> promise;
+	};
+
+	mutable std::mutex m;
+	std::vector<std::shared_ptr<peer>> peers;
+	std::unordered_map<std::string, handler> handlers;
+	std::unordered_map<std::uint64_t, pending_call> calls;
+	std::uint64_t next_id;
+
+	/* handlers running, under m */
+	int running;
+	std::condition_variable running_condition;
+
+	/* whether each pool thread has a send waiting for its function to return */
+	struct slot
+	{
+		slot() : flush_scheduled(false) {}
+
+		/* keep neighbouring flags off each other's cache lines */
+		char pad_before[64];
+		bool flush_scheduled;
+		char pad_after[64];
+	};
+	std::vector<slot> slots;
+
+	/* runs a handler on the pool and sends its result */
+	struct serve
+	{
+		std::shared_ptr<remote_impl> self;
+		peer *from;
+		std::uint64_t id;
+		handler h;
+		std::string arg;
+
+		void operator()();
+	};
+
+	void start_call(const std::string &name, const std::string &arg, pending_call &c);
+	void finish(pending_call &c, bool ok, std::string result);
+	void queue(peer &p, const std::string &messages);
+	void flush(peer &p);
+	void flush_all();
+	void receive(peer *from, std::string &frame);
+	void closed(peer *p);
+};
+
+void ago_remote::remote_impl::serve::operator()()
+{
+	std::string message;
+	try
+	{
+		std::string result = h(arg);
+		message += (char)result_ok;
+		put_u64(message, id);
+		put_bytes(message, result);
+	}
+	catch(std::exception &e)
+	{
+		message += (char)result_failed;
+		put_u64(message, id);
+		put_bytes(message, e.what());
+	}
+	catch(...)
+	{
+		message += (char)result_failed;
+		put_u64(message, id);
+		put_bytes(message, "the handler threw");
+	}
+	self->queue(*from, message);
+
+	std::lock_guard<std::mutex> lock(self->m);
+	if(--self->running == 0) self->running_condition.notify_all();
+}
+
+/* send to the open peer with the fewest calls outstanding */
+void ago_remote::remote_impl::start_call(const std::string &name, const std::string &arg,
+	pending_call &c)
+{
+	peer *to = nullptr;
+	std::uint64_t id = 0;
+	{
+		std::lock_guard<std::mutex> lock(m);
+		for(auto p = peers.begin(); p != peers.end(); ++p)
+		{
+			if((*p)->open && (!to || (*p)->outstanding < to->outstanding)) to = p->get();
+		}
+		if(to)
+		{
+			id = next_id++;
+			++to->outstanding;
+			c.to = to;
+			calls[id] = std::move(c);
+		}
+	}
+	if(!to)
+	{
+		finish(c, false, "no peer is connected");
+		return;
+	}
+
+	std::string message;
+	message += (char)request;
+	put_u64(message, id);
+	put_bytes(message, name);
+	put_bytes(message, arg);
+	queue(*to, message);
+}
+
+void ago_remote::remote_impl::finish(pending_call &c, bool ok, std::string result)
+{
+	if(c.promise)
+	{
+		if(ok) c.promise->set_value(std::move(result));
+		else c.promise->set_exception(std::make_exception_ptr(std::runtime_error(result)));
+		return;
+	}
+	outcome o = { std::move(c.done), ok, std::move(result) };
+	pool->go(std::move(o));
+}
+
+void ago_remote::remote_impl::queue(peer &p, const std::string &messages)
+{
+	int index = pool->worker_index();
+	bool now;
+	{
+		std::lock_guard<std::mutex> lock(p.out_mutex);
+		p.out += messages;
+		now = index < 0 || p.out.size() >= batch_limit;
+	}
+	if(now)
+	{
+		flush(p);
+		return;
+	}
+
+	slot &s = slots[index];
+	if(!s.flush_scheduled)
+	{
+		s.flush_scheduled = true;
+
+		/* the function may go on to destroy the ago_remote */
+		std::shared_ptr<remote_impl> self = shared_from_this();
+		pool->at_return([self, index]{
+			self->slots[index].flush_scheduled = false;
+			self->flush_all();
+		});
+	}
+}
+
+void ago_remote::remote_impl::flush(peer &p)
+{
+	std::unique_lock<std::mutex> lock(p.out_mutex);
+	if(p.sending) return;
+
+	/* whatever is added meanwhile goes out next, from here */
+	p.sending = true;
+	while(!p.out.empty())
+	{
+		std::string frame;
+		frame.swap(p.out);
+		lock.unlock();
+		p.transport->send(frame);
+		lock.lock();
+	}
+	p.sending = false;
+}
+
+void ago_remote::remote_impl::flush_all()
+{
+	std::vector<std::shared_ptr<peer>> all;
+	{
+		std::lock_guard<std::mutex> lock(m);
+		all = peers;
+	}
+	for(auto p = all.begin(); p != all.end(); ++p)
+	{
+		flush(**p);
+	}
+}
+
+void ago_remote::remote_impl::receive(peer *from, std::string &frame)
+{
+	frame_reader r(frame);
+	std::string replies;
+	std::size_t answered = 0;
+	while(!r.done())
+	{
+		int kind = (int)r.get(1);
+		std::uint64_t id = r.get(8);
+
+		if(kind == request)
+		{
+			std::string name = r.bytes();
+			std::string arg = r.bytes();
+			if(!r.ok) break;
+
+			handler h;
+			{
+				std::lock_guard<std::mutex> lock(m);
+				auto found = handlers.find(name);
+				if(found != handlers.end())
+				{
+					h = found->second;
+					++running;
+				}
+			}
+			if(!h)
+			{
+				replies += (char)result_failed;
+				put_u64(replies, id);
+				put_bytes(replies, "no handler for " + name);
+				continue;
+			}
+
+			serve s = { shared_from_this(), from, id, std::move(h), std::move(arg) };
+			pool->go(std::move(s));
+			continue;
+		}
+
+		std::string result = r.bytes();
+		if(!r.ok) break;
+
+		pending_call c;
+		bool found = false;
+		{
+			std::lock_guard<std::mutex> lock(m);
+			auto call = calls.find(id);
+			if(call != calls.end() && call->second.to == from)
+			{
+				c = std::move(call->second);
+				calls.erase(call);
+				found = true;
+			}
+		}
+		if(found)
+		{
+			finish(c, kind == result_ok, std::move(result));
+			++answered;
+		}
+	}
+
+	/* only now, so that once outstanding() is zero every done function
+	 * has been given to go() */
+	if(answered)
+	{
+		std::lock_guard<std::mutex> lock(m);
+		from->outstanding -= answered;
+	}
+
+	if(!replies.empty()) queue(*from, replies);
+}
+
+void ago_remote::remote_impl::closed(peer *p)
+{
+	std::vector<pending_call> failed;
+	{
+		std::lock_guard<std::mutex> lock(m);
+		p->open = false;
+		for(auto call = calls.begin(); call != calls.end(); )
+		{
+			if(call->second.to != p)
+			{
+				++call;
+				continue;
+			}
+			failed.push_back(std::move(call->second));
+			call = calls.erase(call);
+		}
+	}
+	for(auto c = failed.begin(); c != failed.end(); ++c)
+	{
+		finish(*c, false, "the connection ended");
+	}
+
+	std::lock_guard<std::mutex> lock(m);
+	p->outstanding = 0;
+}
+
+ago_remote::ago_remote(ago &pool)
+	: impl(new remote_impl)
+{
+	impl->pool = &pool;
+	impl->next_id = 1;
+	impl->running = 0;
+	impl->slots = std::vector<remote_impl::slot>(pool.worker_slots());
+}
+
+ago_remote::~ago_remote()
+{
+	std::vector<std::shared_ptr<remote_impl::peer>> peers;
+	{
+		std::lock_guard<std::mutex> lock(impl->m);
+		peers = impl->peers;
+	}
+	for(auto p = peers.begin(); p != peers.end(); ++p)
+	{
+		(*p)->transport->close();
+		impl->closed(p->get());
+	}
+
+	std::unique_lock<std::mutex> lock(impl->m);
+	impl->running_condition.wait(lock, [&]{ return impl->running == 0; });
+}
+
+void ago_remote::handle(const std::string &name, handler h)
+{
+	std::lock_guard<std::mutex> lock(impl->m);
+	impl->handlers[name] = std::move(h);
+}
+
+int ago_remote::connect(std::shared_ptr<ago_transport> transport)
+{
+	std::shared_ptr<remote_impl::peer> p(new remote_impl::peer);
+	p->transport = transport;
+	int n;
+	{
+		std::lock_guard<std::mutex> lock(impl->m);
+		n = (int)impl->peers.size();
+		impl->peers.push_back(p);
+	}
+
+	/* the destructor closes the transport before impl can go */
+	remote_impl *self = impl.get();
+	remote_impl::peer *raw = p.get();
+	transport->start([self, raw](std::string &frame){ self->receive(raw, frame); },
+		[self, raw]{ self->closed(raw); });
+	return n;
+}
+
+std::future<std::string> ago_remote::call(const std::string &name, const std::string &arg)
+{
+	remote_impl::pending_call c;
+	c.promise = std::make_shared<std::promise<std::string>>();
+	std::future<std::string> result = c.promise->get_future();
+	impl->start_call(name, arg, c);
+	return result;
+}
+
+void ago_remote::call(const std::string &name, const std::string &arg,
+	std::function<void(bool, std::string)> done)
+{
+	remote_impl::pending_call c;
+	c.done = std::move(done);
+	impl->start_call(name, arg, c);
+}
+
+std::size_t ago_remote::outstanding(int peer) const
+{
+	std::lock_guard<std::mutex> lock(impl->m);
+	if(peer < 0 || peer >= (int)impl->peers.size()) return 0;
+	return impl->peers[peer]->outstanding;
+}
@@ -0,0 +1,176 @@
+#ifndef AGO_REMOTE_H
+#define AGO_REMOTE_H
+
+#include <memory>
+#include <functional>
+#include <future>
+#include <string>
+#include <utility>
+#include <cstdint>
+
+#include "ago.h"
+
+/* A connection to another process or machine, carrying frames of bytes.
+ * ago_remote uses one per peer; implement it to carry calls over
+ * something other than TCP.
+ */
+class ago_transport
+{
+public:
+	virtual ~ago_transport() {}
+
+	/* Called once, before send(). Each frame received is given to
+	 * receive(), from one thread at a time, and closed() is called once
+	 * after the last, when either end ends the connection. */
+	virtual void start(std::function<void(std::string &frame)> receive,
+		std::function<void()> closed) = 0;
+
+	/* send a frame; safe from several threads at once; does nothing once
+	 * the connection has ended */
+	virtual void send(const std::string &frame) = 0;
+
+	/* End the connection. Unless called from receive() or closed(), no
+	 * more calls to them are made once it returns. */
+	virtual void close() = 0;
+};
+
+/* Two transports connected to each other within one process, for tests.
+ * Frames are delivered by a thread of each end's own.
+ */
+class ago_loopback_transport : public ago_transport
+{
+public:
+	static std::pair<std::shared_ptr<ago_transport>, std::shared_ptr<ago_transport>> pair();
+
+	virtual ~ago_loopback_transport();
+	virtual void start(std::function<void(std::string &frame)> receive,
+		std::function<void()> closed);
+	virtual void send(const std::string &frame);
+	virtual void close();
+
+private:
+	ago_loopback_transport();
+	ago_loopback_transport(const ago_loopback_transport &);
+	ago_loopback_transport &operator=(const ago_loopback_transport &);
+
+	struct loopback_impl;
+	std::shared_ptr<loopback_impl> impl;
+};
+
+#ifndef _WIN32
+/* Frames over a TCP connection, each preceded by its length. A peer
+ * that announces a frame longer than max_frame is cut off rather than
+ * given that much memory, so both ends must allow the largest frame
+ * either sends: a batch of calls or results, with their arguments.
+ */
+class ago_tcp_transport : public ago_transport
+{
+public:
+	static const std::uint32_t default_max_frame = 8u << 20;
+
+	/* takes over a connected socket */
+	explicit ago_tcp_transport(int fd, std::uint32_t max_frame = default_max_frame);
+
+	/* connect to host:port; empty on failure */
+	static std::shared_ptr<ago_transport> connect(const std::string &host, int port,
+		std::uint32_t max_frame = default_max_frame);
+
+	virtual ~ago_tcp_transport();
+	virtual void start(std::function<void(std::string &frame)> receive,
+		std::function<void()> closed);
+	virtual void send(const std::string &frame);
+	virtual void close();
+
+private:
+	ago_tcp_transport(const ago_tcp_transport &);
+	ago_tcp_transport &operator=(const ago_tcp_transport &);
+
+	struct tcp_impl;
+	std::shared_ptr<tcp_impl> impl;
+};
+
+/* Accepts TCP connections on every address. */
+class ago_tcp_listener
+{
+public:
+	/* port 0 picks a free one; max_frame is given to each connection */
+	explicit ago_tcp_listener(int port,
+		std::uint32_t max_frame = ago_tcp_transport::default_max_frame);
+	virtual ~ago_tcp_listener();
+
+	/* the port listened on, or -1 if listening failed */
+	int port() const;
+
+	/* wait for a connection; empty once close() is called */
+	std::shared_ptr<ago_transport> accept();
+
+	void close();
+
+private:
+	ago_tcp_listener(const ago_tcp_listener &);
+	ago_tcp_listener &operator=(const ago_tcp_listener &);
+
+	int fd;
+	int bound_port;
+	std::uint32_t max_frame;
+};
+#endif
+
+/* Functions called by name on other processes or machines.
+ *
+ * Each ago_remote is a node that can both serve and call. handle()
+ * registers a function under a name, and call() runs the function of a
+ * name on one of the peers added with connect(), giving it the argument
+ * bytes and getting back the result bytes. The peer's handlers run on
+ * its own ago pool.
+ *
+ * Calls are pipelined: any number may be in flight, and each goes to the
+ * open peer with the fewest outstanding. Calls made by a function running
+ * on the pool are sent together when it returns, in one frame per peer,
+ * and so are the results of handlers on the serving side. Calls from
+ * other threads are sent at once, batched only with any sent while a
+ * frame is already going out.
+ *
+ * A call fails if no peer is open, the peer has no handler of that name,
+ * the handler throws, or the connection ends before it answers.
+ *
+ * The destructor ends every connection, failing calls still in flight,
+ * and waits for handlers already running; it must run before the ago
+ * object is destroyed.
+ */
+class ago_remote
+{
+public:
+	typedef std::function<std::string(const std::string &arg)> handler;
+
+	explicit ago_remote(ago &pool);
+	virtual ~ago_remote();
+
+	/* serve name; register handlers before connecting peers that call them */
+	void handle(const std::string &name, handler h);
+
+	/* add a peer, starting its transport; returns its number */
+	int connect(std::shared_ptr<ago_transport> transport);
+
+	/* The result of name(arg) on a peer. On failure get() throws
+	 * std::runtime_error saying why. */
+	std::future<std::string> call(const std::string &name, const std::string &arg);
+
+	/* The same, giving done(ok, result) to ago::go(). On failure ok is
+	 * false and result says why. */
+	void call(const std::string &name, const std::string &arg,
+		std::function<void(bool, std::string)> done);
+
+	/* Calls sent to peer and not yet answered. Once it is zero, the done
+	 * functions of those answered have been given to ago::go(). */
+	std::size_t outstanding(int peer) const;
+
+private:
+	ago_remote(const ago_remote &);
+	ago_remote &operator=(const ago_remote &);
+
+	struct remote_impl;
+	std::shared_ptr<remote_impl> impl;
+};
+
+#endif	/* AGO_REMOTE_H */
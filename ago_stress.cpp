@@ -0,0 +1,1689 @@
+/* COMPILE: "cmake -DAGO_SANITIZE=thread ." (or address) then "make ago_stress".
+ * RUN: ago_stress [-s seed] [-r rounds]
+ */
+
+/* randomized stress test of the lightweight thread implementation in ago */
+
+/** Every round builds a pool of random size and checks, from several
+ * threads at once:
+ *  - every function submitted runs exactly once, including functions
+ *    submitted by other functions and keyed ones,
+ *  - when ago::wait() returns, everything the waiting thread submitted
+ *    before calling it has finished,
+ *  - functions with the same key run in order and never together,
+ *  - those three also hold for basic_ago with every policy changed,
+ *  - functions keep running while every thread is in a blocking region,
+ *  - go_blocking() functions run exactly once, hand their results back
+ *    to the pool, never use more threads than allowed, and each get
+ *    their own ago_worker_local instance,
+ *  - idle hooks are removed promptly while threads keep parking, and
+ *    never run once removed,
+ *  - an ago_actor sent to by many producers at once receives each
+ *    message once, each producer's in the order sent, and never on two
+ *    threads at once,
+ *  - ago_parallel_sort and the scans give what std::sort and
+ *    std::partial_sum do, for every size from empty up,
+ *  - an ago_graph never starts a node before all of its predecessors
+ *    have finished, whether in a diamond or a wide fan-in,
+ *  - an ago_pipeline hands serial in order filters their items in input
+ *    order, never runs a serial filter twice at once, and does run its
+ *    parallel filters on several items at once,
+ *  - a file written and read back in pieces through ago_io, with
+ *    io_uring and with the blocking threads, holds what was written, and
+ *    a 4 GiB transfer through io_uring reports a partial count,
+ *  - remote calls over a loopback transport are each answered once,
+ *    and fail when the peer goes away or, over TCP, when they do not
+ *    fit in the frame size the peer allows,
+ *  - a child process of an ago_process_pool that crashes fails only
+ *    its own call, and its replacement serves the calls after it,
+ *  - a lock-free stack reclaiming through ago_reclaim, used from pool
+ *    functions and an outside thread, pops each value once and frees
+ *    every node once (run it under the address sanitizer),
+ *  - ago_hash_map, written and read from pool functions and an outside
+ *    thread at once, only ever shows values that were stored, and ends
+ *    up holding exactly what was left in it, on basic_ago with every
+ *    policy changed too,
+ *  - ago_sync locks exclude each other whether taken by waiting or by
+ *    queued functions, and a function waiting on a semaphore lets the
+ *    function that releases it run on a one thread pool,
+ *  - destroying a pool that still has work, some of it in blocking
+ *    regions, neither hangs nor runs any function twice.
+ * Before the rounds it checks once that latency percentiles land in the
+ * expected buckets for known distributions, zero among them, and that a
+ * trace parses as JSON even when a thread name holds quotes and
+ * backslashes.
+ * A watchdog aborts the run if a round takes far too long. The exit
+ * status is non zero if any check failed.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <numeric>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <future>
+#include <stdexcept>
+#include <csignal>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <sstream>
+#include "ago.h"
+#include "ago_impl.h"
+#include "ago_actor.h"
+#include "ago_algorithm.h"
+#include "ago_graph.h"
+#include "ago_hash_map.h"
+#ifndef _WIN32
+#include "ago_io.h"
+#endif
+#include "ago_pipeline.h"
+#include "ago_reclaim.h"
+#include "ago_remote.h"
+#include "ago_worker_local.h"
+#ifdef __linux__
+#include "ago_process.h"
+#endif
+#include "ago_sync.h"
+#include "ago_trace.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static std::atomic<int> failures(0);
+
+static void check(bool ok, const std::string &what)
+{
+	if(!ok)
+	{
+		++failures;
+		std::cerr << "FAILED: " << what << std::endl;
+	}
+}
+
+/* aborts the process unless disarmed within the timeout */
+class watchdog
+{
+public:
+	explicit watchdog(int seconds)
+		: done(false), t([this, seconds]{
+			std::unique_lock<std::mutex> lock(m);
+			if(!c.wait_for(lock, std::chrono::seconds(seconds), [this]{ return done; }))
+			{
+				std::cerr << "FAILED: round hung" << std::endl;
+				std::abort();
+			}
+		})
+	{
+	}
+
+	~watchdog()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m);
+			done = true;
+		}
+		c.notify_all();
+		t.join();
+	}
+
+private:
+	bool done;
+	std::mutex m;
+	std::condition_variable c;
+	std::thread t;
+};
+
+/* every policy the other way from ago's, to check they work too */
+typedef basic_ago<ago_lifo_queue<false>, ago_spin_wait<20>, ago_task_storage<0>, ago_no_stats>
+	lean_ago;
+
+/* Functions, each with its own slot, some of which submit children.
+ * Returns the number of slots used. */
+template<class Pool>
+static int submit_tree(Pool &r, std::vector<std::atomic<int>> &runs, std::atomic<int> &next,
+	std::mt19937 &rng, int depth)
+{
+	int id = next++;
+	if(id >= (int)runs.size()) return 0;
+
+	bool keyed = rng() % 3 == 0;
+	int children = depth > 0 ? (int)(rng() % 3) : 0;
+	unsigned child_seed = rng();
+
+	auto func = [&r, &runs, &next, id, children, child_seed, depth]{
+		++runs[id];
+		std::mt19937 child_rng(child_seed);
+		for(int c = 0; c < children; ++c)
+		{
+			submit_tree(r, runs, next, child_rng, depth - 1);
+		}
+	};
+
+	if(keyed) r.go(id % 7, func);
+	else r.go(func);
+	return 1;
+}
+
+template<class Pool>
+static void exactly_once(unsigned seed, int threads, int producers)
+{
+	const int slots = 20000;
+	std::vector<std::atomic<int>> runs(slots);
+	for(auto i = runs.begin(); i != runs.end(); ++i) *i = 0;
+	std::atomic<int> next(0);
+
+	{
+		Pool r(threads);
+		std::vector<std::thread> submitters;
+		for(int p = 0; p < producers; ++p)
+		{
+			submitters.push_back(std::thread([&, p]{
+				std::mt19937 rng(seed + p);
+
+				for(int i = 0; i < 200; ++i)
+				{
+					submit_tree(r, runs, next, rng, 3);
+
+					/* everything this thread submitted is done once
+					 * wait() returns */
+					if(rng() % 50 == 0)
+					{
+						int before = 64;
+						std::atomic<int> finished(0);
+						for(int j = 0; j < before; ++j)
+						{
+							r.go([&finished]{ ++finished; });
+						}
+						r.wait();
+						check(finished == before, "wait() returned before its functions finished");
+					}
+				}
+			}));
+		}
+		for(auto t = submitters.begin(); t != submitters.end(); ++t)
+		{
+			t->join();
+		}
+		r.wait();
+
+		int used = std::min(next.load(), slots);
+		for(int i = 0; i < used; ++i)
+		{
+			if(runs[i] != 1)
+			{
+				check(false, "function " + std::to_string(i) + " ran " +
+					std::to_string(runs[i].load()) + " times");
+				break;
+			}
+		}
+	}
+}
+
+template<class Pool>
+static void keyed_order(unsigned seed, int threads)
+{
+	const int keys = 64;
+	std::vector<int> last(keys, -1);
+	std::vector<std::atomic<int>> inside(keys);
+	for(auto i = inside.begin(); i != inside.end(); ++i) *i = 0;
+	std::atomic<bool> ok(true);
+
+	Pool r(threads);
+	std::mt19937 rng(seed);
+	for(int i = 0; i < 20000; ++i)
+	{
+		int key = (int)(rng() % keys);
+		r.go(key, [&, key, i]{
+			if(inside[key]++ != 0) ok = false;
+			if(last[key] >= i) ok = false;
+			last[key] = i;
+			--inside[key];
+		});
+		if(rng() % 4 == 0) r.go([]{});
+	}
+	r.wait();
+	check(ok, "keyed functions ran out of order or together");
+
+	/* no threads asked for: one anyway, which keyed functions go to */
+	Pool none(0);
+	std::atomic<int> ran(0);
+	none.go(seed, [&ran]{ ++ran; });
+	none.wait();
+	check(ran == 1, "keyed function on a pool of 0 threads did not run");
+}
+
+static void blocking_regions(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	for(int round = 0; round < 5; ++round)
+	{
+		const int quick = 1000;
+		std::atomic<int> quick_done(0);
+		std::mutex m;
+		std::condition_variable c;
+		bool released = false;
+
+		ago r(threads);
+
+		/* Block every thread until the quick functions are done, which
+		 * only spare threads can run. Some regions are nested. */
+		for(int i = 0; i < threads; ++i)
+		{
+			bool nested = rng() % 2 == 0;
+			r.go([&, nested]{
+				ago::blocking_region region(r);
+				std::unique_ptr<ago::blocking_region> inner;
+				if(nested) inner.reset(new ago::blocking_region(r));
+
+				std::unique_lock<std::mutex> lock(m);
+				c.wait_for(lock, std::chrono::seconds(30), [&]{ return released; });
+			});
+		}
+		for(int i = 0; i < quick; ++i)
+		{
+			r.go([&]{
+				if(++quick_done == quick)
+				{
+					std::lock_guard<std::mutex> lock(m);
+					released = true;
+					c.notify_all();
+				}
+			});
+		}
+		r.wait();
+		check(released, "functions were held up by threads in blocking regions");
+	}
+}
+
+static void blocking_tier(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	int max_spare = 1 + (int)(rng() % 4);
+	int max_blocking = 1 + (int)(rng() % 4);
+	const int count = 2000;
+	std::vector<std::atomic<int>> runs(count);
+	for(auto i = runs.begin(); i != runs.end(); ++i) *i = 0;
+	std::atomic<bool> on_pool(true);
+
+	ago r(threads, max_spare);
+	r.blocking_limits(max_blocking, 1 + (int)(rng() % 5));
+	for(int i = 0; i < count; ++i)
+	{
+		int sleep_us = (int)(rng() % 50);
+		switch(rng() % 3)
+		{
+		case 0:
+			r.go_blocking([&runs, i, sleep_us]{
+				std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+				++runs[i];
+			});
+			break;
+		case 1:
+			r.go_blocking([sleep_us, i]{
+				std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+				return i;
+			}, [&](int result){
+				if(r.worker_index() < 0) on_pool = false;
+				++runs[result];
+			});
+			break;
+		default:
+			r.go([&r, &runs, i, sleep_us]{
+				ago::blocking_region region(r);
+				std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+				++runs[i];
+			});
+			break;
+		}
+
+		if(i % 100 == 0)
+		{
+			int used = r.snapshot().blocking_threads;
+			check(used <= std::min(max_spare, max_blocking), "too many blocking threads");
+		}
+	}
+	r.wait();
+
+	check(on_pool, "go_blocking() result handed to a thread outside the pool");
+	for(int i = 0; i < count; ++i)
+	{
+		if(runs[i] != 1)
+		{
+			check(false, "blocking function " + std::to_string(i) + " ran " +
+				std::to_string(runs[i].load()) + " times");
+			break;
+		}
+	}
+	ago::stats st = r.snapshot();
+	check(st.total.executed == st.total.submitted, "go_blocking() functions not counted as run");
+
+	/* go_blocking() threads, many at once, each with an instance of their own */
+	{
+		ago_worker_local<int> counts(r);
+		const int adds = 500;
+		for(int i = 0; i < adds; ++i)
+		{
+			if(i % 2) r.go_blocking([&counts]{ ++counts.local(); });
+			else r.go([&counts]{ ++counts.local(); });
+		}
+		r.wait();
+		int sum = 0;
+		counts.for_each([&sum](int n){ sum += n; });
+		check(sum == adds, "ago_worker_local lost counts from go_blocking() threads");
+	}
+
+	/* no budget for blocking threads, by max_spare or by the limit */
+	for(int limit = 0; limit < 2; ++limit)
+	{
+		ago none(threads, limit ? 2 : 0);
+		if(limit) none.blocking_limits(0, 1);
+		std::atomic<int> done(0);
+		none.go_blocking([&done]{ ++done; });
+		none.go_blocking([&done]{ ++done; }, [&done]{ ++done; });
+		none.wait();
+		check(done == 3, "go_blocking() functions did not run without a budget");
+	}
+}
+
+/* Hooks added and removed while threads keep running out of work and
+ * waking up again. */
+static void idle_hooks(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	ago r(threads);
+	std::atomic<bool> stop(false), ok(true);
+	std::thread churn([&r, &stop]{
+		while(!stop)
+		{
+			r.go([]{});
+			std::this_thread::sleep_for(std::chrono::microseconds(20));
+		}
+	});
+
+	for(int i = 0; i < 200; ++i)
+	{
+		std::shared_ptr<std::atomic<bool>> added = std::make_shared<std::atomic<bool>>(true);
+		int id = r.add_idle_hook([added, &ok](int){ if(!*added) ok = false; });
+		std::this_thread::sleep_for(std::chrono::microseconds(rng() % 200));
+		r.remove_idle_hook(id);
+		*added = false;
+	}
+
+	stop = true;
+	churn.join();
+	r.wait();
+	check(ok, "idle hook ran after remove_idle_hook() returned");
+}
+
+/* Records every message it receives: each producer's messages must
+ * arrive once each and in the order sent, and receive() must never run
+ * on two threads at once. A small batch makes it reschedule often. */
+class recording_actor : public ago_actor<std::pair<int, int>, 4>
+{
+public:
+	recording_actor(ago &pool, int producers)
+		: ago_actor<std::pair<int, int>, 4>(pool), next(producers, 0), received(0),
+		out_of_order(0), active(0), overlapped(false)
+	{
+	}
+
+	std::vector<int> next;		/* sequence number due from each producer */
+	int received;
+	int out_of_order;
+	std::atomic<int> active;
+	std::atomic<bool> overlapped;
+
+protected:
+	void receive(std::pair<int, int> &msg)
+	{
+		if(active.fetch_add(1) != 0) overlapped = true;
+		if(msg.second != next[msg.first]) ++out_of_order;
+		next[msg.first] = msg.second + 1;
+		++received;
+		if(msg.second % 64 == 0) std::this_thread::yield();
+		active.fetch_sub(1);
+	}
+};
+
+/* Many producers, pool functions and outside threads, all sending to one
+ * actor at once. */
+static void actor_messages(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	const int producers = 2 + (int)(rng() % 7);
+	const int count = 2000 + (int)(rng() % 2000);
+
+	ago r(threads);
+	recording_actor actor(r, producers);
+	auto produce = [&actor, count](int p){
+		for(int i = 0; i < count; ++i) actor.send(std::make_pair(p, i));
+	};
+
+	std::vector<std::thread> outside;
+	for(int p = 0; p < producers; ++p)
+	{
+		if(p % 2) outside.push_back(std::thread(produce, p));
+		else r.go([&produce, p]{ produce(p); });
+	}
+	for(auto t = outside.begin(); t != outside.end(); ++t) t->join();
+	r.wait();
+
+	check(!actor.overlapped, "ago_actor received on two threads at once");
+	check(actor.out_of_order == 0, "ago_actor received " + std::to_string(actor.out_of_order) +
+		" messages out of order");
+	check(actor.received == producers * count, "ago_actor received " +
+		std::to_string(actor.received) + " of " + std::to_string(producers * count) + " messages");
+	bool all = true;
+	for(int p = 0; p < producers; ++p) all = all && actor.next[p] == count;
+	check(all, "ago_actor lost the last messages of a producer");
+}
+
+/* x -> first * x + second, composed left to right: associative but not
+ * commutative, so a scan combining blocks out of order shows */
+static std::pair<std::uint64_t, std::uint64_t> compose(const std::pair<std::uint64_t, std::uint64_t> &f,
+	const std::pair<std::uint64_t, std::uint64_t> &g)
+{
+	return std::make_pair(g.first * f.first, g.first * f.second + g.second);
+}
+
+/* Parallel sorts and scans against std::sort and std::partial_sum, for
+ * empty and single element ranges, ranges around the size below which
+ * they run serially, and random larger ones. */
+static void algorithms(unsigned seed, int threads)
+{
+	typedef std::pair<std::uint64_t, std::uint64_t> affine;
+
+	std::mt19937 rng(seed);
+	std::vector<std::size_t> sizes;
+	sizes.push_back(0);
+	sizes.push_back(1);
+	sizes.push_back(2 + rng() % 100);
+	sizes.push_back(ago_detail::serial_cutoff - 1);
+	sizes.push_back(ago_detail::serial_cutoff + 1);
+	for(int i = 0; i < 3; ++i) sizes.push_back(rng() % (20 * ago_detail::serial_cutoff));
+
+	ago r(threads);
+	for(auto n = sizes.begin(); n != sizes.end(); ++n)
+	{
+		std::string at = " on " + std::to_string(*n) + " elements";
+
+		/* few distinct values, so there are plenty of ties */
+		std::vector<int> v(*n);
+		for(auto x = v.begin(); x != v.end(); ++x) *x = (int)(rng() % (1 + *n / 8));
+		std::vector<int> sorted = v, expected = v;
+		ago_parallel_sort(r, sorted.begin(), sorted.end());
+		std::sort(expected.begin(), expected.end());
+		check(sorted == expected, "ago_parallel_sort differs from std::sort" + at);
+
+		sorted = v;
+		ago_parallel_sort(r, sorted.begin(), sorted.end(), std::greater<int>());
+		std::sort(expected.begin(), expected.end(), std::greater<int>());
+		check(sorted == expected, "ago_parallel_sort with a comparison differs from std::sort" + at);
+
+		std::vector<std::uint64_t> w(v.begin(), v.end()), sums(*n), partial(*n);
+		ago_inclusive_scan(r, w.begin(), w.end(), sums.begin());
+		std::partial_sum(w.begin(), w.end(), partial.begin());
+		check(sums == partial, "ago_inclusive_scan differs from std::partial_sum" + at);
+
+		ago_exclusive_scan(r, w.begin(), w.end(), w.begin(), std::uint64_t(5));
+		bool same = true;
+		for(std::size_t i = 0; i < *n; ++i) same = same && w[i] == (i ? partial[i - 1] : 0) + 5;
+		check(same, "ago_exclusive_scan in place differs from std::partial_sum" + at);
+
+		std::vector<affine> f(*n), composed(*n), expected_composed(*n);
+		for(auto x = f.begin(); x != f.end(); ++x) *x = affine(rng() | 1, rng());
+		ago_inclusive_scan(r, f.begin(), f.end(), composed.begin(), compose);
+		std::partial_sum(f.begin(), f.end(), expected_composed.begin(), compose);
+		check(composed == expected_composed, "ago_inclusive_scan combined out of order" + at);
+	}
+}
+
+/* A graph holding a diamond, a wide fan-in to one node and a random
+ * acyclic part, run a few times over. Each node notes when it started
+ * and finished on a shared clock, and every edge must see its before
+ * node finish ahead of its after node starting. */
+static void graph_order(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	const int fan_in = 64;
+	const int random_nodes = 40;
+
+	ago r(threads);
+	ago_graph g;
+	std::atomic<int> clock(0);
+	std::vector<std::pair<int, int>> edges;
+	std::vector<int> started, finished;
+	std::vector<std::atomic<int>> runs(4 + fan_in + 1 + random_nodes);
+
+	auto add = [&]() -> int {
+		int n = (int)started.size();
+		started.push_back(0);
+		finished.push_back(0);
+		int added = (int)g.add([&, n]{
+			started[n] = ++clock;
+			if(n % 3 == 0) std::this_thread::yield();
+			++runs[n];
+			finished[n] = ++clock;
+		});
+		check(added == n, "ago_graph numbered its nodes out of order");
+		return n;
+	};
+	auto precede = [&](int before, int after){
+		g.precede(before, after);
+		edges.push_back(std::make_pair(before, after));
+	};
+
+	int top = add(), left = add(), right = add(), bottom = add();
+	precede(top, left);
+	precede(top, right);
+	precede(left, bottom);
+	precede(right, bottom);
+
+	int sink = add();
+	for(int i = 0; i < fan_in; ++i)
+	{
+		int n = add();
+		precede(n, sink);
+		if(i % 8 == 0) precede(bottom, n);
+	}
+
+	int first = (int)started.size();
+	for(int i = 0; i < random_nodes; ++i) add();
+	for(int i = first; i < first + random_nodes; ++i)
+	{
+		for(int j = i + 1; j < first + random_nodes; ++j)
+		{
+			if(rng() % 8 == 0) precede(i, j);
+		}
+	}
+
+	const int rounds = 3;
+	for(int round = 0; round < rounds; ++round)
+	{
+		g.run(r);
+		g.wait();
+
+		int late = 0;
+		for(auto e = edges.begin(); e != edges.end(); ++e)
+		{
+			if(finished[e->first] >= started[e->second]) ++late;
+		}
+		check(late == 0, "ago_graph started " + std::to_string(late) +
+			" nodes before a predecessor finished");
+	}
+
+	bool all = true;
+	for(auto n = runs.begin(); n != runs.end(); ++n) all = all && *n == rounds;
+	check(all, "ago_graph did not run every node once per run");
+}
+
+/* Items numbered by the input pass through a parallel filter that holds
+ * each for a random time, so they leave it out of order, then a serial
+ * in order filter that must see them in input order, another parallel
+ * filter and a serial out of order one that frees them. The serial
+ * filters must never run twice at once, and with more than one thread
+ * and token the parallel one should. */
+static void pipeline_order(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	const int items = 300;
+	const std::size_t tokens = 1 + rng() % 8;
+
+	ago r(threads);
+	ago_pipeline p;
+	int produced = 0, expected = 0, consumed = 0;
+	std::atomic<int> in_parallel(0), most_parallel(0), in_order(0), out_of_order(0);
+	std::atomic<int> in_any_order(0);
+	std::atomic<bool> overlapped(false);
+
+	std::mutex delays_mutex;
+	auto delay = [&rng, &delays_mutex]{
+		std::lock_guard<std::mutex> lock(delays_mutex);
+		return std::chrono::microseconds(rng() % 200);
+	};
+	auto enter_serial = [&overlapped](std::atomic<int> &in){
+		if(in.fetch_add(1) != 0) overlapped = true;
+	};
+
+	p.add_filter(ago_pipeline::serial_in_order, [&produced, items](void *) -> void* {
+		return produced < items ? new int(produced++) : nullptr;
+	});
+	p.add_filter(ago_pipeline::parallel, [&](void *item) -> void* {
+		int now = ++in_parallel;
+		for(int most = most_parallel; now > most && !most_parallel.compare_exchange_weak(most, now); )
+		{
+		}
+		std::this_thread::sleep_for(delay());
+		--in_parallel;
+		return item;
+	});
+	p.add_filter(ago_pipeline::serial_in_order, [&](void *item) -> void* {
+		enter_serial(in_order);
+		if(*(int*)item != expected) ++out_of_order;
+		expected = *(int*)item + 1;
+		--in_order;
+		return item;
+	});
+	p.add_filter(ago_pipeline::parallel, [](void *item) -> void* {
+		std::this_thread::yield();
+		return item;
+	});
+	p.add_filter(ago_pipeline::serial_out_of_order, [&](void *item) -> void* {
+		enter_serial(in_any_order);
+		++consumed;
+		delete (int*)item;
+		--in_any_order;
+		return nullptr;
+	});
+
+	for(int run = 0; run < 2; ++run)
+	{
+		produced = expected = consumed = 0;
+		out_of_order = 0;
+		p.run(r, tokens);
+		p.wait();
+
+		check(consumed == items, "ago_pipeline passed " + std::to_string(consumed) + " of " +
+			std::to_string(items) + " items");
+		check(out_of_order == 0, "ago_pipeline gave a serial in order filter " +
+			std::to_string(out_of_order) + " items out of order");
+		check(!overlapped, "ago_pipeline ran a serial filter twice at once");
+	}
+	check(threads < 2 || tokens < 2 || most_parallel > 1,
+		"ago_pipeline never ran a parallel filter on two items at once");
+}
+
+#ifndef _WIN32
+/* Moves [at, end) of base to or from the same offsets of fd through
+ * ago_io, starting the rest again wherever a partial transfer stopped,
+ * and counts itself into finished when all of it has gone or it fails. */
+struct io_piece
+{
+	ago_io *io;
+	int fd;
+	bool is_read;
+	char *base;
+	std::size_t at, end;
+	std::atomic<int> *errors;
+	std::function<void()> *finished;
+
+	void start()
+	{
+		io_piece rest = *this;
+		auto done = [rest](long res) mutable {
+			if(res <= 0) ++*rest.errors;
+			else rest.at += (std::size_t)res;
+			if(res > 0 && rest.at < rest.end) rest.start();
+			else (*rest.finished)();
+		};
+		if(is_read) io->read(fd, base + at, end - at, (std::int64_t)at, done);
+		else io->write(fd, base + at, end - at, (std::int64_t)at, done);
+	}
+};
+
+/* A temporary file written through ago_io in random pieces, some started
+ * by pool functions, then read back in other pieces and compared; once
+ * with io_uring where there is one and once with the blocking threads.
+ * With io_uring, a 4 GiB write to /dev/null from memory that is only
+ * reserved must report a partial transfer rather than the nothing its
+ * length cut to 32 bits would ask for. The blocking calls take the full
+ * length, and a sanitizer would check all of it. */
+static void io_round_trip(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	const std::size_t size = 1 + rng() % (4 << 20);
+	std::vector<char> data(size), back(size);
+	for(auto c = data.begin(); c != data.end(); ++c) *c = (char)rng();
+
+	for(int use_uring = 1; use_uring >= 0; --use_uring)
+	{
+		std::string how = use_uring ? " (io_uring if there is one)" : " (blocking threads)";
+		char path[] = "/tmp/ago_stress_XXXXXX";
+		int fd = mkstemp(path);
+		check(fd >= 0, "could not create a temporary file");
+		if(fd < 0) return;
+		unlink(path);
+
+		ago r(threads);
+		ago_io io(r, 1 + rng() % 64, use_uring != 0);
+		std::atomic<int> errors(0);
+		std::mutex m;
+		std::condition_variable c;
+		int pieces = 0, done = 0;
+		std::function<void()> finished = [&m, &c, &done]{
+			std::lock_guard<std::mutex> lock(m);
+			++done;
+			c.notify_all();
+		};
+
+		for(int is_read = 0; is_read < 2; ++is_read)
+		{
+			pieces = done = 0;
+			for(std::size_t at = 0; at < size; ++pieces)
+			{
+				std::size_t end = std::min(size, at + 1 + rng() % (256 << 10));
+				io_piece p = { &io, fd, is_read != 0, is_read ? &back[0] : &data[0], at, end,
+					&errors, &finished };
+				if(rng() % 2) r.go([p]() mutable { p.start(); });
+				else p.start();
+				at = end;
+			}
+			std::unique_lock<std::mutex> lock(m);
+			c.wait(lock, [&]{ return done == pieces; });
+		}
+		r.wait();
+
+		check(errors == 0, "ago_io failed " + std::to_string(errors.load()) + " transfers" + how);
+		check(data == back, "ago_io read back other than it wrote" + how);
+		close(fd);
+
+		int null = io.uring() ? open("/dev/null", O_WRONLY) : -1;
+		const std::size_t huge = (std::size_t)1 << 32;
+		void *reserved = null < 0 || sizeof(void*) < 8 ? MAP_FAILED : mmap(nullptr, huge, PROT_READ,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(null >= 0 && reserved != MAP_FAILED)
+		{
+			std::promise<long> wrote;
+			io.write(null, reserved, huge, -1, [&wrote](long res){ wrote.set_value(res); });
+			long res = wrote.get_future().get();
+			check(res > 0 && (std::size_t)res < huge, "ago_io wrote " + std::to_string(res) +
+				" bytes of 4 GiB");
+			r.wait();
+		}
+		if(reserved != MAP_FAILED) munmap(reserved, huge);
+		if(null >= 0) close(null);
+	}
+}
+#endif
+
+/* Calls between two nodes over a loopback pair, some from pool functions
+ * and some from outside, with futures and done functions, including
+ * calls that fail. Then a server goes away with calls in flight. */
+static void remote_calls(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	const int count = 2000;
+	std::vector<std::atomic<int>> answers(count);
+	for(auto i = answers.begin(); i != answers.end(); ++i) *i = 0;
+
+	ago client_pool(threads);
+	ago server_pool(1 + (int)(rng() % 4));
+	{
+		ago_remote client(client_pool);
+		ago_remote server(server_pool);
+		server.handle("twice", [](const std::string &arg){ return arg + arg; });
+		server.handle("throw", [](const std::string &) -> std::string {
+			throw std::runtime_error("thrown");
+		});
+
+		std::pair<std::shared_ptr<ago_transport>, std::shared_ptr<ago_transport>> link =
+			ago_loopback_transport::pair();
+		server.connect(link.second);
+		client.connect(link.first);
+
+		std::vector<std::future<std::string>> futures;
+		for(int i = 0; i < count; ++i)
+		{
+			std::string arg = std::to_string(i);
+			auto answer = [&answers, i, arg](bool ok, std::string result){
+				if(ok && result == arg + arg) ++answers[i];
+			};
+
+			switch(rng() % 4)
+			{
+			case 0:
+				futures.push_back(client.call("twice", arg));
+				break;
+			case 1:
+				client.call("twice", arg, answer);
+				break;
+			default:
+				client_pool.go([&client, arg, answer]{ client.call("twice", arg, answer); });
+				break;
+			}
+		}
+
+		for(std::size_t f = 0; f < futures.size(); ++f)
+		{
+			std::string result = futures[f].get();
+			int i = std::atoi(result.substr(0, result.size() / 2).c_str());
+			++answers[i];
+		}
+
+		std::atomic<int> failed(0);
+		client.call("throw", "", [&failed](bool ok, std::string why){
+			if(!ok && why == "thrown") ++failed;
+		});
+		client.call("missing", "", [&failed](bool ok, std::string){ if(!ok) ++failed; });
+
+		/* once every call has been made, wait for the answers */
+		client_pool.wait();
+		while(client.outstanding(0)) std::this_thread::yield();
+		client_pool.wait();
+		check(failed == 2, "a call that should have failed did not");
+		for(int i = 0; i < count; ++i)
+		{
+			if(answers[i] != 1)
+			{
+				check(false, "remote call " + std::to_string(i) + " answered " +
+					std::to_string(answers[i].load()) + " times");
+				break;
+			}
+		}
+	}
+
+	std::atomic<int> failed(0), answered(0);
+	{
+		ago_remote client(client_pool);
+		std::unique_ptr<ago_remote> server(new ago_remote(server_pool));
+		server->handle("slow", [](const std::string &arg){
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			return arg;
+		});
+		std::pair<std::shared_ptr<ago_transport>, std::shared_ptr<ago_transport>> link =
+			ago_loopback_transport::pair();
+		server->connect(link.second);
+		client.connect(link.first);
+
+		for(int i = 0; i < 200; ++i)
+		{
+			client.call("slow", "x", [&failed, &answered](bool ok, std::string){
+				if(ok) ++answered;
+				else ++failed;
+			});
+		}
+		server.reset();
+
+		/* the client end hears of the close on its own thread; a hang
+		 * here means calls were left outstanding */
+		while(client.outstanding(0)) std::this_thread::yield();
+		client_pool.wait();
+		check(answered + failed == 200, "a call neither answered nor failed after the peer went away");
+
+		bool threw = false;
+		try { client.call("slow", "x").get(); }
+		catch(std::runtime_error &) { threw = true; }
+		check(threw, "a call with no open peer did not fail");
+	}
+	client_pool.wait();
+
+#ifndef _WIN32
+	/* over TCP, a frame longer than the receiving end allows ends the
+	 * connection, failing the call, instead of being read */
+	{
+		ago_tcp_listener listener(0, 4096);
+		ago_remote client(client_pool);
+		ago_remote server(server_pool);
+		server.handle("echo", [](const std::string &arg){ return arg; });
+
+		std::shared_ptr<ago_transport> outgoing =
+			ago_tcp_transport::connect("127.0.0.1", listener.port());
+		check(outgoing != nullptr, "could not connect over TCP");
+		if(!outgoing) return;
+		server.connect(listener.accept());
+		client.connect(outgoing);
+
+		std::string small;
+		try { small = client.call("echo", "small").get(); }
+		catch(std::runtime_error &) {}
+		check(small == "small", "a call over TCP within max_frame failed");
+
+		bool threw = false;
+		try { client.call("echo", std::string(8192, 'x')).get(); }
+		catch(std::runtime_error &) { threw = true; }
+		check(threw, "a frame over the receiver's max_frame did not end the connection");
+	}
+	client_pool.wait();
+	server_pool.wait();
+#endif
+}
+
+#ifdef __linux__
+static std::string echo(const std::string &arg)
+{
+	return arg;
+}
+
+static std::string crash(const std::string &)
+{
+	/* not through a sanitizer's handler */
+	std::signal(SIGSEGV, SIG_DFL);
+	std::raise(SIGSEGV);
+	return std::string();
+}
+
+/* Children that crash in a call, each followed by calls that must be
+ * answered by what is running after it. */
+static void process_crashes(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	ago r(threads);
+	std::vector<ago_process_pool::func> funcs;
+	funcs.push_back(&echo);
+	funcs.push_back(&crash);
+
+	ago_process_pool children(r, funcs, 1 + (int)(rng() % 2));
+	const int crashes = 1 + (int)(rng() % 3);
+	for(int c = 0; c < crashes; ++c)
+	{
+		std::promise<bool> crashed;
+		std::future<bool> crash_result = crashed.get_future();
+		children.call(1, std::string(), [&crashed](bool ok, std::string){ crashed.set_value(ok); });
+		check(!crash_result.get(), "call that crashed its child succeeded");
+		check(children.restarts() == c + 1, "crashed child not replaced");
+
+		const int calls = 20;
+		std::vector<std::promise<bool>> answered(calls);
+		for(int i = 0; i < calls; ++i)
+		{
+			std::string arg = std::to_string(c) + "." + std::to_string(i);
+			std::promise<bool> *p = &answered[i];
+			children.call(0, arg, [p, arg](bool ok, std::string result){
+				p->set_value(ok && result == arg);
+			});
+		}
+		for(int i = 0; i < calls; ++i)
+		{
+			if(!answered[i].get_future().get())
+			{
+				check(false, "call after a crash failed or was answered wrongly");
+				break;
+			}
+		}
+	}
+}
+#endif
+
+/* Treiber stack whose popped nodes go to an ago_reclaim */
+class reclaimed_stack
+{
+public:
+	static std::atomic<int> freed;
+
+	explicit reclaimed_stack(ago_reclaim &domain) : domain(domain), head(nullptr) {}
+
+	void push(int value)
+	{
+		node *n = new node(value);
+		n->next = head.load(std::memory_order_relaxed);
+		while(!head.compare_exchange_weak(n->next, n, std::memory_order_release,
+			std::memory_order_relaxed))
+		{
+		}
+	}
+
+	/* -1 when empty */
+	int pop()
+	{
+		ago_reclaim::guard g(domain);
+		node *n = g.protect(head);
+		while(n)
+		{
+			node *next = n->next;
+			if(head.compare_exchange_strong(n, next, std::memory_order_acquire,
+				std::memory_order_relaxed))
+			{
+				int value = n->value;
+				domain.retire(n);
+				return value;
+			}
+			n = g.protect(head);
+		}
+		return -1;
+	}
+
+private:
+	struct node
+	{
+		explicit node(int value) : value(value), next(nullptr) {}
+		~node() { ++freed; }
+
+		int value;
+		node *next;
+	};
+
+	ago_reclaim &domain;
+	std::atomic<node*> head;
+};
+
+std::atomic<int> reclaimed_stack::freed(0);
+
+static void reclaim_stack(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	const int count = 20000;
+	std::vector<std::atomic<int>> pops(count);
+	for(auto i = pops.begin(); i != pops.end(); ++i) *i = 0;
+	reclaimed_stack::freed = 0;
+
+	ago r(threads);
+	{
+		ago_reclaim domain(r, 1 + rng() % 32);
+		reclaimed_stack stack(domain);
+		auto popped = [&pops](int value){ if(value >= 0) ++pops[value]; };
+
+		/* functions push a share each and pop about as many, while a
+		 * thread off the pool pushes and pops the rest */
+		const int outside = count / 4;
+		const int chunk = 100;
+		for(int from = outside; from < count; from += chunk)
+		{
+			r.go([&stack, &popped, from, chunk, count]{
+				for(int i = from; i < from + chunk && i < count; ++i)
+				{
+					stack.push(i);
+					if(i % 3) popped(stack.pop());
+				}
+			});
+		}
+		std::thread other([&stack, &popped, outside]{
+			for(int i = 0; i < outside; ++i)
+			{
+				stack.push(i);
+				popped(stack.pop());
+			}
+		});
+		other.join();
+		r.wait();
+
+		for(int value; (value = stack.pop()) >= 0; ) popped(value);
+	}
+
+	for(int i = 0; i < count; ++i)
+	{
+		if(pops[i] != 1)
+		{
+			check(false, "stack value " + std::to_string(i) + " popped " +
+				std::to_string(pops[i].load()) + " times");
+			break;
+		}
+	}
+	check(reclaimed_stack::freed == count, "ago_reclaim freed " +
+		std::to_string(reclaimed_stack::freed.load()) + " of " + std::to_string(count) + " nodes");
+}
+
+/* Writers each own the keys equal to their number modulo the writer
+ * count and remember what they leave; every value stored for key k is
+ * k plus a multiple of 7, which readers check meanwhile. All of them
+ * also add to one shared counter. */
+template<class Pool>
+static void hash_map(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	const int keys = 3000;
+	const int writers = 8;
+	const int counter = -1;
+	std::vector<int> expected(keys, -1);
+	std::atomic<int> bad(0), increments(0);
+
+	Pool r(threads);
+	{
+		ago_hash_map<int, int, std::hash<int>, std::equal_to<int>, Pool> map(r, 1 + rng() % 4);
+		std::atomic<bool> writing(true);
+
+		auto read = [&map, &bad, keys](std::mt19937 &read_rng){
+			int k = (int)(read_rng() % keys);
+			int v;
+			if(map.find(k, v) && (v < k || (v - k) % 7)) ++bad;
+		};
+
+		for(int w = 0; w < writers; ++w)
+		{
+			unsigned writer_seed = rng();
+			r.go([&map, &expected, &increments, w, writer_seed, keys, writers, counter]{
+				std::mt19937 write_rng(writer_seed);
+				for(int op = 0; op < 4000; ++op)
+				{
+					int k = w + writers * (int)(write_rng() % (keys / writers));
+					int v = k + 7 * (int)(write_rng() % 100);
+					switch(write_rng() % 4)
+					{
+					case 0:
+						if(map.insert(k, v)) expected[k] = v;
+						break;
+					case 1:
+						map.assign(k, v);
+						expected[k] = v;
+						break;
+					case 2:
+						map.erase(k);
+						expected[k] = -1;
+						break;
+					default:
+						map.update(counter, [](int &n){ ++n; });
+						++increments;
+						break;
+					}
+				}
+			});
+		}
+		for(int f = 0; f < 4 * threads; ++f)
+		{
+			unsigned reader_seed = rng();
+			r.go([&read, &writing, reader_seed]{
+				std::mt19937 read_rng(reader_seed);
+				for(int i = 0; i < 1000 || (writing && i < 100000); ++i) read(read_rng);
+			});
+		}
+		std::thread other([&read, &writing, &rng]{
+			std::mt19937 read_rng(rng());
+			while(writing) read(read_rng);
+		});
+		r.wait();
+		writing = false;
+		other.join();
+
+		check(bad == 0, "ago_hash_map showed a value never stored");
+		std::size_t present = 0;
+		for(int k = 0; k < keys; ++k)
+		{
+			int v = -1;
+			map.find(k, v);
+			if(v != expected[k])
+			{
+				check(false, "ago_hash_map holds " + std::to_string(v) + " for key " +
+					std::to_string(k) + " instead of " + std::to_string(expected[k]));
+				break;
+			}
+			if(v >= 0) ++present;
+		}
+		int total = 0;
+		map.find(counter, total);
+		check(total == increments, "ago_hash_map lost updates to a shared key");
+		std::size_t visited = 0;
+		map.for_each([&visited](int, int){ ++visited; });
+		check(map.size() == present + (increments ? 1 : 0) && visited == map.size(),
+			"ago_hash_map size is wrong");
+
+		/* an update that throws changes nothing, and leaks nothing */
+		try
+		{
+			map.update(counter, [](int &v){ v = -1; throw std::runtime_error("update"); });
+		}
+		catch(const std::runtime_error &)
+		{
+		}
+		total = 0;
+		map.find(counter, total);
+		check(total == increments, "ago_hash_map kept a thrown update");
+	}
+}
+
+static void sync_locks(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+
+	{
+		ago r(threads);
+		ago_sync_mutex m(r);
+		int counter = 0;
+		const int count = 2000;
+		for(int i = 0; i < count; ++i)
+		{
+			if(rng() % 2) r.go([&m, &counter]{ std::lock_guard<ago_sync_mutex> lock(m); ++counter; });
+			else m.go_locked([&counter]{ ++counter; });
+		}
+		std::thread other([&m, &counter]{
+			for(int i = 0; i < count; ++i)
+			{
+				std::lock_guard<ago_sync_mutex> lock(m);
+				++counter;
+			}
+		});
+		other.join();
+		r.wait();
+		check(counter == 2 * count, "ago_sync_mutex let two holders in");
+	}
+
+	/* each waiter is ahead of its releaser, so a waiter must not hold
+	 * the only thread */
+	{
+		const int waiters = 1 + (int)(rng() % 4);
+		ago r(1, waiters);
+		ago_sync_semaphore sem(r);
+		std::atomic<int> got(0);
+		for(int i = 0; i < waiters; ++i) r.go([&sem, &got]{ sem.acquire(); ++got; });
+		for(int i = 0; i < waiters; ++i) sem.go_acquired([&got]{ ++got; });
+		for(int i = 0; i < 2 * waiters; ++i) r.go([&sem]{ sem.release(); });
+		r.wait();
+		check(got == 2 * waiters, "ago_sync_semaphore waiters did not all get through");
+	}
+
+	{
+		ago r(threads);
+		ago_sync_shared_mutex rw(r);
+		int a = 0, b = 0;
+		std::atomic<int> torn(0), writes(0);
+		const int count = 2000;
+		for(int i = 0; i < count; ++i)
+		{
+			auto write = [&a, &b, &writes, i]{
+				a = i;
+				std::this_thread::yield();
+				b = i;
+				++writes;
+			};
+			auto read = [&a, &b, &torn]{ if(a != b) ++torn; };
+			switch(rng() % 4)
+			{
+			case 0:
+				r.go([&rw, write]{ rw.lock(); write(); rw.unlock(); });
+				break;
+			case 1:
+				rw.go_locked(write);
+				break;
+			case 2:
+				r.go([&rw, read]{ rw.lock_shared(); read(); rw.unlock_shared(); });
+				break;
+			default:
+				rw.go_shared(read);
+				break;
+			}
+		}
+		r.wait();
+		check(torn == 0, "ago_sync_shared_mutex let a reader in with a writer");
+	}
+
+	/* a writer from go_locked() gets in while readers keep overlapping */
+	{
+		ago r(2 + (int)(rng() % 3));
+		ago_sync_shared_mutex rw(r);
+		std::atomic<bool> written(false), starved(false);
+		const int chains = 4;
+		const int limit = 2000;
+		std::function<void(int)> read = [&](int left){
+			if(written) return;
+			if(!left)
+			{
+				starved = true;
+				return;
+			}
+			auto next = [&read, left]{ read(left - 1); };
+			if(left % 2)
+			{
+				rw.lock_shared();
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+				rw.unlock_shared();
+				r.go(next);
+			}
+			else
+			{
+				rw.go_shared([&r, next]{
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+					r.go(next);
+				});
+			}
+		};
+		for(int c = 0; c < chains; ++c) r.go([&read, limit]{ read(limit); });
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		rw.go_locked([&written]{ written = true; });
+		r.wait();
+		check(written && !starved, "ago_sync_shared_mutex starved a queued writer");
+	}
+
+	/* consumers on the pool wait for an outside producer */
+	{
+		ago r(threads);
+		ago_sync_mutex m(r);
+		ago_sync_condition_variable ready(r);
+		std::vector<int> items;
+		bool done = false;
+		long long sum = 0;
+		const int count = 5000;
+
+		for(int c = 0; c < 1 + threads; ++c)
+		{
+			r.go([&]{
+				std::unique_lock<ago_sync_mutex> lock(m);
+				for(;;)
+				{
+					ready.wait(lock, [&]{ return done || !items.empty(); });
+					if(items.empty()) return;
+					sum += items.back();
+					items.pop_back();
+				}
+			});
+		}
+		for(int i = 1; i <= count; ++i)
+		{
+			std::lock_guard<ago_sync_mutex> lock(m);
+			items.push_back(i);
+			ready.notify_one();
+		}
+		{
+			std::lock_guard<ago_sync_mutex> lock(m);
+			done = true;
+		}
+		ready.notify_all();
+		r.wait();
+		check(sum == (long long)count * (count + 1) / 2, "ago_sync_condition_variable lost items");
+	}
+}
+
+static void destroy_busy(unsigned seed, int threads)
+{
+	std::mt19937 rng(seed);
+	for(int round = 0; round < 20; ++round)
+	{
+		const int count = 1000;
+		std::vector<std::atomic<int>> runs(count);
+		for(auto i = runs.begin(); i != runs.end(); ++i) *i = 0;
+
+		{
+			/* every other round some functions are in blocking regions,
+			 * starting spares, while the pool goes */
+			bool blocking = round % 2 == 1;
+			ago r(threads);
+			for(int i = 0; i < count; ++i)
+			{
+				if(blocking && rng() % 8 == 0)
+				{
+					r.go([&r, &runs, i]{
+						ago::blocking_region region(r);
+						std::this_thread::sleep_for(std::chrono::microseconds(100));
+						++runs[i];
+					});
+				}
+				else if(rng() % 2) r.go([&runs, i]{ ++runs[i]; });
+				else r.go(i, [&runs, i]{ ++runs[i]; });
+			}
+
+			/* destroyed here, usually with work still queued */
+		}
+
+		for(int i = 0; i < count; ++i)
+		{
+			check(runs[i] <= 1, "function ran twice during destruction");
+		}
+	}
+}
+
+/* Percentiles of histograms filled with known values, each of which
+ * must come out as the middle of the bucket holding the exact answer. */
+static void latency_percentiles()
+{
+	typedef ago_detail::histogram histogram;
+
+	struct expect
+	{
+		const char *what;
+		std::uint64_t p50, p99, p999, max;
+	};
+	auto check_case = [](const std::vector<std::uint64_t> &values, const expect &e){
+		std::unique_ptr<histogram> h(new histogram);
+		for(auto v = values.begin(); v != values.end(); ++v) h->record(*v);
+		std::vector<std::uint64_t> sum(histogram::bucket_count);
+		h->add_to(sum);
+		ago_latency l = histogram::percentiles(sum);
+
+		auto mid = [](std::uint64_t v){ return histogram::value(histogram::bucket(v)); };
+		check(l.count == values.size() && l.p50_ns == mid(e.p50) && l.p99_ns == mid(e.p99) &&
+			l.p999_ns == mid(e.p999) && l.max_ns == mid(e.max),
+			std::string("latency percentiles wrong for ") + e.what + ": p50 " +
+			std::to_string(l.p50_ns) + " p99 " + std::to_string(l.p99_ns) + " p999 " +
+			std::to_string(l.p999_ns) + " max " + std::to_string(l.max_ns));
+	};
+
+	std::vector<std::uint64_t> v(100, 0);
+	expect zeros = { "all zero", 0, 0, 0, 0 };
+	check_case(v, zeros);
+
+	v.assign(990, 0);
+	v.insert(v.end(), 10, 5000);
+	expect mostly_zero = { "99% zero", 0, 0, 5000, 5000 };
+	check_case(v, mostly_zero);
+
+	v.assign(98, 1000);
+	v.insert(v.end(), 2, 1000000);
+	expect tail = { "a 2% tail", 1000, 1000000, 1000000, 1000000 };
+	check_case(v, tail);
+
+	v.clear();
+	for(std::uint64_t i = 1; i <= 1000; ++i) v.push_back(i);
+	expect uniform = { "1 to 1000", 500, 990, 999, 1000 };
+	check_case(v, uniform);
+
+	/* and the middle of a bucket is within the promised 6% */
+	bool close = true;
+	for(std::uint64_t x = 1; x < 10000000; x = x * 3 / 2 + 1)
+	{
+		std::uint64_t m = histogram::value(histogram::bucket(x));
+		close = close && (m > x ? m - x : x - m) * 100 <= x * 6;
+	}
+	check(close, "latency histogram bucket is more than 6% off");
+}
+
+/* A strict JSON reader, just enough to tell whether a trace parses. It
+ * keeps every string it reads, unescaped. */
+class json_reader
+{
+public:
+	explicit json_reader(const std::string &text) : text(text), at(0) {}
+
+	bool parse()
+	{
+		space();
+		if(!value()) return false;
+		space();
+		return at == text.size();
+	}
+
+	std::vector<std::string> strings;
+
+private:
+	std::string text;
+	std::size_t at;
+
+	bool peek(char c) const { return at < text.size() && text[at] == c; }
+	bool take(char c) { if(!peek(c)) return false; ++at; return true; }
+
+	void space()
+	{
+		while(peek(' ') || peek('\t') || peek('\r') || peek('\n')) ++at;
+	}
+
+	bool value()
+	{
+		if(peek('{')) return object();
+		if(peek('[')) return array();
+		if(peek('"')) return string();
+		if(peek('t')) return word("true");
+		if(peek('f')) return word("false");
+		if(peek('n')) return word("null");
+		return number();
+	}
+
+	bool word(const char *w)
+	{
+		std::size_t n = std::string(w).size();
+		if(text.compare(at, n, w) != 0) return false;
+		at += n;
+		return true;
+	}
+
+	bool object()
+	{
+		take('{');
+		space();
+		if(take('}')) return true;
+		for(;;)
+		{
+			space();
+			if(!string()) return false;
+			space();
+			if(!take(':')) return false;
+			space();
+			if(!value()) return false;
+			space();
+			if(take('}')) return true;
+			if(!take(',')) return false;
+		}
+	}
+
+	bool array()
+	{
+		take('[');
+		space();
+		if(take(']')) return true;
+		for(;;)
+		{
+			space();
+			if(!value()) return false;
+			space();
+			if(take(']')) return true;
+			if(!take(',')) return false;
+		}
+	}
+
+	bool string()
+	{
+		if(!take('"')) return false;
+		std::string s;
+		for(;;)
+		{
+			if(at >= text.size()) return false;
+			unsigned char c = (unsigned char)text[at++];
+			if(c == '"') break;
+			if(c < 0x20) return false;
+			if(c != '\\')
+			{
+				s += (char)c;
+				continue;
+			}
+			if(at >= text.size()) return false;
+			char e = text[at++];
+			const char *plain = "\"\\/bfnrt", *means = "\"\\/\b\f\n\r\t";
+			const char *found = e ? std::strchr(plain, e) : nullptr;
+			if(found) s += means[found - plain];
+			else if(e == 'u' && at + 4 <= text.size())
+			{
+				unsigned code = 0;
+				for(int i = 0; i < 4; ++i)
+				{
+					char h = text[at++];
+					if(!std::isxdigit((unsigned char)h)) return false;
+					code = code * 16 + (unsigned)(std::isdigit((unsigned char)h) ? h - '0' :
+						std::tolower((unsigned char)h) - 'a' + 10);
+				}
+				s += code < 0x80 ? (char)code : '?';
+			}
+			else return false;
+		}
+		strings.push_back(s);
+		return true;
+	}
+
+	bool number()
+	{
+		std::size_t start = at;
+		take('-');
+		if(!digits()) return false;
+		if(take('.') && !digits()) return false;
+		if(take('e') || take('E'))
+		{
+			if(!take('+')) take('-');
+			if(!digits()) return false;
+		}
+		return at > start;
+	}
+
+	bool digits()
+	{
+		std::size_t start = at;
+		while(at < text.size() && std::isdigit((unsigned char)text[at])) ++at;
+		return at > start;
+	}
+};
+
+/* A trace taken while a pool runs, from a thread whose name holds
+ * quotes, backslashes and control characters, must parse as JSON and
+ * give the name back unchanged. */
+static void trace_json()
+{
+	const std::string name = std::string("say \"hi\" from C:\\pool\\") + '\n' + '\t' + '\x01';
+
+	ago_trace::start(1024);
+	{
+		ago r(2);
+		std::thread named([&r, &name]{
+			ago_trace::name_thread(name);
+			for(int i = 0; i < 100; ++i) r.go([]{});
+			r.wait();
+		});
+		named.join();
+	}
+	ago_trace::stop();
+
+	std::ostringstream out;
+	ago_trace::write(out);
+	json_reader json(out.str());
+	check(json.parse(), "ago_trace wrote a trace that is not JSON");
+	check(std::find(json.strings.begin(), json.strings.end(), name) != json.strings.end(),
+		"ago_trace did not give back a thread name with quotes and backslashes");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned seed = 1;
+	int rounds = 4;
+
+	for(int i = 1; i + 1 < argc; i += 2)
+	{
+		std::string opt = argv[i];
+		if(opt == "-s") seed = (unsigned)std::strtoul(argv[i + 1], nullptr, 10);
+		else if(opt == "-r") rounds = std::atoi(argv[i + 1]);
+	}
+
+	latency_percentiles();
+	trace_json();
+
+	std::mt19937 rng(seed);
+	for(int round = 0; round < rounds; ++round)
+	{
+		int threads = 1 + (int)(rng() % 8);
+		int producers = 1 + (int)(rng() % 4);
+		std::cout << "round " << round << ": " << threads << " threads, "
+			<< producers << " producers" << std::endl;
+
+		watchdog dog(120);
+		exactly_once<ago>(rng(), threads, producers);
+		keyed_order<ago>(rng(), threads);
+		exactly_once<lean_ago>(rng(), threads, producers);
+		keyed_order<lean_ago>(rng(), threads);
+		blocking_regions(rng(), threads);
+		blocking_tier(rng(), threads);
+		idle_hooks(rng(), threads);
+		actor_messages(rng(), threads);
+		algorithms(rng(), threads);
+		graph_order(rng(), threads);
+		pipeline_order(rng(), threads);
+#ifndef _WIN32
+		io_round_trip(rng(), threads);
+#endif
+		remote_calls(rng(), threads);
+#ifdef __linux__
+		process_crashes(rng(), threads);
+#endif
+		reclaim_stack(rng(), threads);
+		hash_map<ago>(rng(), threads);
+		hash_map<lean_ago>(rng(), threads);
+		sync_locks(rng(), threads);
+		destroy_busy(rng(), threads);
+	}
+
+	std::cout << (failures ? "FAILED" : "passed") << std::endl;
+	return failures ? 1 : 0;
+}
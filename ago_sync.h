@@ -0,0 +1,471 @@
+#ifndef AGO_SYNC_H
+#define AGO_SYNC_H
+
+/* Locks for functions run by an ago pool.
+ *
+ * A function that waits for a std::mutex holds up its thread, and the
+ * pool cannot tell that other queued functions could run meanwhile. These
+ * types try a few times first, yielding in between, and then wait inside
+ * an ago::blocking_region, so a spare thread runs other functions until
+ * the wait ends. Off the pool they wait like the std types.
+ *
+ * The mutex, semaphore and shared mutex can also take a function to run
+ * holding the lock, with go_locked() and the like, so that no thread
+ * waits at all: while the lock is held the function is queued on it, and
+ * each release gives the first queued function to ago::go(), to take the
+ * lock when it runs or queue again if someone else took it first. A
+ * function never holds the lock while it sits in the pool's queue, which
+ * could leave every thread waiting for it; for the same reason a release
+ * also wakes a waiting thread.
+ *
+ * They must be destroyed before the ago object, with nothing queued.
+ *
+ * Each is a template on the pool type, basic_ago_sync_mutex<Pool> and so
+ * on, for a basic_ago with other policies; the plain names are for ago.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cstddef>
+
+#include "ago.h"
+
+template<class Pool = ago>
+class basic_ago_sync_mutex
+{
+public:
+	/* spins: tries, yielding in between, before waiting */
+	explicit basic_ago_sync_mutex(Pool &pool, int spins = 64)
+		: pool(pool), spins(spins), state(0)
+	{
+	}
+
+	bool try_lock()
+	{
+		int free = 0;
+		return state.compare_exchange_strong(free, 1, std::memory_order_acquire,
+			std::memory_order_relaxed);
+	}
+
+	void lock()
+	{
+		if(try_lock()) return;
+		for(int i = 0; i < spins; ++i)
+		{
+			std::this_thread::yield();
+			if(state.load(std::memory_order_relaxed) == 0 && try_lock()) return;
+		}
+
+		typename Pool::blocking_region region(pool);
+		std::unique_lock<std::mutex> lock(m);
+		while(state.exchange(2, std::memory_order_acquire) != 0) woken.wait(lock);
+	}
+
+	void unlock()
+	{
+		if(state.exchange(0, std::memory_order_release) == 1) return;
+
+		std::function<void()> next;
+		{
+			std::lock_guard<std::mutex> lock(m);
+			if(!queued.empty())
+			{
+				next = std::move(queued.front());
+				queued.pop_front();
+			}
+			woken.notify_one();
+		}
+		if(next) go_attempt(std::move(next));
+	}
+
+	/* run f on the pool holding the lock */
+	template<class F>
+	void go_locked(F f)
+	{
+		go_attempt(std::function<void()>(f));
+	}
+
+private:
+	basic_ago_sync_mutex(const basic_ago_sync_mutex &);
+	basic_ago_sync_mutex &operator=(const basic_ago_sync_mutex &);
+
+	void go_attempt(std::function<void()> f)
+	{
+		pool.go([this, f]{ attempt(f); });
+	}
+
+	/* On the pool: run f holding the lock, or queue it again at the
+	 * front, where unlock() took it from, until the next release. The
+	 * lock is taken marked, as others may be queued behind f, which only
+	 * a marked unlock() hands on. */
+	void attempt(const std::function<void()> &f)
+	{
+		int free = 0;
+		if(!state.compare_exchange_strong(free, 2, std::memory_order_acquire,
+			std::memory_order_relaxed))
+		{
+			std::unique_lock<std::mutex> lock(m);
+			for(;;)
+			{
+				/* marked, the holder's unlock() comes through m */
+				int s = state.load(std::memory_order_relaxed);
+				if(s == 2 || (s == 1 && state.compare_exchange_weak(s, 2,
+					std::memory_order_relaxed)))
+				{
+					queued.push_front(f);
+					return;
+				}
+				if(s == 0 && state.compare_exchange_weak(s, 2, std::memory_order_acquire,
+					std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+		}
+		f();
+		unlock();
+	}
+
+	Pool &pool;
+	int spins;
+
+	/* 0 free, 1 locked, 2 locked and maybe something waiting */
+	std::atomic<int> state;
+
+	std::mutex m;
+	std::condition_variable woken;
+	std::deque<std::function<void()>> queued;
+};
+
+typedef basic_ago_sync_mutex<> ago_sync_mutex;
+
+/* A counting semaphore. */
+template<class Pool = ago>
+class basic_ago_sync_semaphore
+{
+public:
+	explicit basic_ago_sync_semaphore(Pool &pool, std::size_t count = 0, int spins = 64)
+		: pool(pool), spins(spins), count(count)
+	{
+	}
+
+	bool try_acquire()
+	{
+		std::lock_guard<std::mutex> lock(m);
+		if(!count.load(std::memory_order_relaxed)) return false;
+		count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	void acquire()
+	{
+		if(try_acquire()) return;
+		for(int i = 0; i < spins; ++i)
+		{
+			std::this_thread::yield();
+			if(count.load(std::memory_order_relaxed) && try_acquire()) return;
+		}
+
+		typename Pool::blocking_region region(pool);
+		std::unique_lock<std::mutex> lock(m);
+		woken.wait(lock, [this]{ return count.load(std::memory_order_relaxed) != 0; });
+		count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+	}
+
+	void release(std::size_t n = 1)
+	{
+		std::vector<std::function<void()>> next;
+		{
+			std::lock_guard<std::mutex> lock(m);
+			std::size_t c = count.load(std::memory_order_relaxed) + n;
+			count.store(c, std::memory_order_relaxed);
+			while(next.size() < c && !queued.empty())
+			{
+				next.push_back(std::move(queued.front()));
+				queued.pop_front();
+			}
+			if(c == 1) woken.notify_one();
+			else woken.notify_all();
+		}
+		for(auto f = next.begin(); f != next.end(); ++f)
+		{
+			go_attempt(std::move(*f));
+		}
+	}
+
+	/* run f on the pool holding one of the count */
+	template<class F>
+	void go_acquired(F f)
+	{
+		std::function<void()> run(f);
+		{
+			std::lock_guard<std::mutex> lock(m);
+			if(!count.load(std::memory_order_relaxed))
+			{
+				queued.push_back(std::move(run));
+				return;
+			}
+		}
+		go_attempt(std::move(run));
+	}
+
+private:
+	basic_ago_sync_semaphore(const basic_ago_sync_semaphore &);
+	basic_ago_sync_semaphore &operator=(const basic_ago_sync_semaphore &);
+
+	void go_attempt(std::function<void()> f)
+	{
+		pool.go([this, f]{ attempt(f); });
+	}
+
+	/* on the pool: run f holding one of the count, or queue it until the
+	 * next release */
+	void attempt(const std::function<void()> &f)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m);
+			std::size_t c = count.load(std::memory_order_relaxed);
+			if(!c)
+			{
+				queued.push_front(f);
+				return;
+			}
+			count.store(c - 1, std::memory_order_relaxed);
+		}
+		f();
+		release();
+	}
+
+	Pool &pool;
+	int spins;
+
+	/* changed under m; read without it only to spin */
+	std::atomic<std::size_t> count;
+
+	std::mutex m;
+	std::condition_variable woken;
+	std::deque<std::function<void()>> queued;
+};
+
+typedef basic_ago_sync_semaphore<> ago_sync_semaphore;
+
+/* A readers-writer lock. Once a writer waits, whether a thread in lock()
+ * or a function from go_locked(), new readers wait behind it. */
+template<class Pool = ago>
+class basic_ago_sync_shared_mutex
+{
+public:
+	explicit basic_ago_sync_shared_mutex(Pool &pool, int spins = 64)
+		: pool(pool), spins(spins), readers(0), writer(false), writers_waiting(0),
+		writers_queued(0)
+	{
+	}
+
+	bool try_lock()
+	{
+		std::lock_guard<std::mutex> lock(m);
+		if(writer || readers) return false;
+		writer = true;
+		return true;
+	}
+
+	bool try_lock_shared()
+	{
+		std::lock_guard<std::mutex> lock(m);
+		if(writer || writers_waiting || writers_queued) return false;
+		++readers;
+		return true;
+	}
+
+	void lock()
+	{
+		if(spin(&basic_ago_sync_shared_mutex::try_lock)) return;
+
+		typename Pool::blocking_region region(pool);
+		std::unique_lock<std::mutex> lock(m);
+		++writers_waiting;
+		woken.wait(lock, [this]{ return !writer && !readers; });
+		--writers_waiting;
+		writer = true;
+	}
+
+	void lock_shared()
+	{
+		if(spin(&basic_ago_sync_shared_mutex::try_lock_shared)) return;
+
+		typename Pool::blocking_region region(pool);
+		std::unique_lock<std::mutex> lock(m);
+		woken.wait(lock, [this]{ return !writer && !writers_waiting && !writers_queued; });
+		++readers;
+	}
+
+	void unlock()
+	{
+		std::vector<queued_func> next;
+		{
+			std::lock_guard<std::mutex> lock(m);
+			writer = false;
+			released(next);
+		}
+		go_all(next);
+	}
+
+	void unlock_shared()
+	{
+		std::vector<queued_func> next;
+		{
+			std::lock_guard<std::mutex> lock(m);
+			if(--readers) return;
+			released(next);
+		}
+		go_all(next);
+	}
+
+	/* run f on the pool holding the lock */
+	template<class F>
+	void go_locked(F f)
+	{
+		go_attempt(queued_func(true, std::function<void()>(f)));
+	}
+
+	/* run f on the pool holding the lock shared */
+	template<class F>
+	void go_shared(F f)
+	{
+		go_attempt(queued_func(false, std::function<void()>(f)));
+	}
+
+private:
+	basic_ago_sync_shared_mutex(const basic_ago_sync_shared_mutex &);
+	basic_ago_sync_shared_mutex &operator=(const basic_ago_sync_shared_mutex &);
+
+	/* true: exclusive */
+	typedef std::pair<bool, std::function<void()>> queued_func;
+
+	bool spin(bool (basic_ago_sync_shared_mutex::*attempt)())
+	{
+		if((this->*attempt)()) return true;
+		for(int i = 0; i < spins; ++i)
+		{
+			std::this_thread::yield();
+			if((this->*attempt)()) return true;
+		}
+		return false;
+	}
+
+	/* With m held, once the lock is free or shared: take the first queued
+	 * writer, or the queued readers up to the next writer, and wake the
+	 * waiting threads. */
+	void released(std::vector<queued_func> &next)
+	{
+		while(!queued.empty())
+		{
+			bool exclusive = queued.front().first;
+			if(exclusive && !next.empty()) break;
+			next.push_back(std::move(queued.front()));
+			queued.pop_front();
+			if(exclusive)
+			{
+				--writers_queued;
+				break;
+			}
+		}
+		woken.notify_all();
+	}
+
+	void go_all(std::vector<queued_func> &next)
+	{
+		for(auto f = next.begin(); f != next.end(); ++f)
+		{
+			go_attempt(std::move(*f), true);
+		}
+	}
+
+	void go_attempt(queued_func f, bool handed = false)
+	{
+		pool.go([this, f, handed]{ attempt(f, handed); });
+	}
+
+	/* On the pool: run f holding the lock, or queue it until the next
+	 * release. A function new to the lock queues at the back, so readers
+	 * stay behind a queued writer; one handed on by released() goes back
+	 * to the front, and as a reader is not held up by the writers queued
+	 * behind it, which wait for it to finish. */
+	void attempt(const queued_func &f, bool handed)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m);
+			int writers_ahead = writers_waiting + (handed ? 0 : writers_queued);
+			if(writer || (f.first ? readers != 0 : writers_ahead != 0))
+			{
+				if(f.first) ++writers_queued;
+				if(handed) queued.push_front(f);
+				else queued.push_back(f);
+				return;
+			}
+			if(f.first) writer = true;
+			else ++readers;
+		}
+		f.second();
+		if(f.first) unlock();
+		else unlock_shared();
+	}
+
+	Pool &pool;
+	int spins;
+
+	/* all under m */
+	int readers;
+	bool writer;
+	int writers_waiting;		/* threads in lock() */
+	int writers_queued;		/* exclusive functions in queued */
+	std::deque<queued_func> queued;
+
+	std::mutex m;
+	std::condition_variable woken;
+};
+
+typedef basic_ago_sync_shared_mutex<> ago_sync_shared_mutex;
+
+/* A condition variable to use with ago_sync_mutex, or a std::unique_lock
+ * of one, or any other lock. A thread waits in a blocking region, and
+ * lock() on waking may wait in one again. */
+template<class Pool = ago>
+class basic_ago_sync_condition_variable
+{
+public:
+	explicit basic_ago_sync_condition_variable(Pool &pool) : pool(pool) {}
+
+	void notify_one() { woken.notify_one(); }
+	void notify_all() { woken.notify_all(); }
+
+	template<class Lock>
+	void wait(Lock &lock)
+	{
+		typename Pool::blocking_region region(pool);
+		woken.wait(lock);
+	}
+
+	template<class Lock, class Predicate>
+	void wait(Lock &lock, Predicate pred)
+	{
+		while(!pred()) wait(lock);
+	}
+
+private:
+	basic_ago_sync_condition_variable(const basic_ago_sync_condition_variable &);
+	basic_ago_sync_condition_variable &operator=(const basic_ago_sync_condition_variable &);
+
+	Pool &pool;
+	std::condition_variable_any woken;
+};
+
+typedef basic_ago_sync_condition_variable<> ago_sync_condition_variable;
+
+#endif	/* AGO_SYNC_H */
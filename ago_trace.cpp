@@ -0,0 +1,6 @@
+/* scheduler event tracing for ago */
+
+/* The definitions are in ago_trace_impl.h, which header-only builds
+ * include instead. */
+
+#include "ago_trace_impl.h"
@@ -0,0 +1,66 @@
+#ifndef AGO_TRACE_H
+#define AGO_TRACE_H
+
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+#include "ago_config.h"
+
+/* Scheduler event tracing for ago, written out in the Chrome trace event
+ * format that chrome://tracing and ui.perfetto.dev load.
+ *
+ * Tracing is off until start() is called and covers every pool in the
+ * process. Each thread records into its own ring buffer of the given
+ * size without taking locks; when a buffer is full the oldest events are
+ * overwritten. write() can be called at any time.
+ */
+class ago_trace
+{
+public:
+	static void start(std::size_t events_per_thread);
+	static void stop();
+	static void write(std::ostream &out);
+
+	static bool enabled()
+	{
+		return on().load(std::memory_order_relaxed);
+	}
+
+	/* The rest is for ago itself. */
+
+	enum event_type
+	{
+		submit,		/* arg: function id */
+		run_begin,	/* arg: function id */
+		run_end,	/* arg: function id */
+		steal,		/* arg: function id */
+		park,
+		unpark,
+		wake		/* arg: index of the thread woken */
+	};
+
+	/* label the calling thread in the output */
+	static void name_thread(const std::string &name);
+
+	static void record(event_type type, std::uint64_t arg = 0);
+
+	/* record a submission and return the new function's id */
+	static std::uint64_t record_submit();
+
+private:
+	/* a static of an inline function, so that it needs no library */
+	static std::atomic<bool> &on()
+	{
+		static std::atomic<bool> flag(false);
+		return flag;
+	}
+};
+
+#ifdef AGO_HEADER_ONLY
+#include "ago_trace_impl.h"
+#endif
+
+#endif	/* AGO_TRACE_H */
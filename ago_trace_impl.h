@@ -0,0 +1,319 @@
+#ifndef AGO_TRACE_IMPL_H
+#define AGO_TRACE_IMPL_H
+
+/* scheduler event tracing for ago */
+
+/* Every thread that records an event gets a buffer, registered once in a
+ * list under a mutex. After that the thread writes events into its own
+ * buffer with relaxed stores and publishes them by advancing head, so
+ * recording never locks. Event fields are atomics so that write() may
+ * copy a buffer while its owner keeps recording; it reads head before
+ * and after copying and drops whatever was overwritten in between.
+ *
+ * ago_trace::start() bumps a generation number. A thread that sees a new
+ * generation takes the mutex once to reset its buffer to the new size,
+ * so buffers are only ever resized by their owner. Buffers of threads
+ * that have exited are kept for write() until the next start().
+ *
+ * Function ids are the buffer's thread id in the top bits and a per
+ * thread sequence number below, so handing them out needs no shared
+ * counter.
+ *
+ * As in ago_mutex the shared state lives in statics of functions, so
+ * that a header-only build has one copy of it.
+ */
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <cstdarg>
+
+#include "ago_trace.h"
+
+namespace ago_trace_detail
+{
+	struct event
+	{
+		std::atomic<std::uint64_t> ts;
+		std::atomic<std::uint64_t> arg;
+		std::atomic<std::uint32_t> type;
+	};
+
+	struct buffer
+	{
+		std::string name;
+		std::uint64_t tid;
+		std::uint64_t generation;
+		std::unique_ptr<event[]> events;
+		std::size_t capacity;
+		std::atomic<std::uint64_t> head;
+		std::uint64_t next_id;
+		std::atomic<bool> alive;
+	};
+
+	struct registry_state
+	{
+		registry_state() : next_tid(1), capacity(0), generation(0), epoch_ns(0) {}
+
+		std::mutex m;
+		std::vector<std::unique_ptr<buffer>> buffers;
+		std::uint64_t next_tid;
+		std::size_t capacity;
+		std::atomic<std::uint64_t> generation;
+		std::atomic<std::uint64_t> epoch_ns;
+	};
+
+	AGO_INLINE registry_state &registry()
+	{
+		static registry_state r;
+		return r;
+	}
+
+	struct thread_state
+	{
+		thread_state() : buf(nullptr) {}
+
+		/* let the next start() drop our buffer */
+		~thread_state()
+		{
+			if(buf) buf->alive.store(false);
+		}
+
+		buffer *buf;
+		std::string name;
+	};
+
+	AGO_INLINE thread_state &self()
+	{
+		thread_local thread_state s;
+		return s;
+	}
+
+	inline std::uint64_t now_ns()
+	{
+		return (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/* the calling thread's buffer, set up for the current generation */
+	AGO_INLINE buffer *own_buffer()
+	{
+		thread_state &me = self();
+		registry_state &r = registry();
+		buffer *b = me.buf;
+		std::uint64_t g = r.generation.load(std::memory_order_acquire);
+		if(b && b->generation == g) return b;
+
+		std::lock_guard<std::mutex> lock(r.m);
+		if(!b)
+		{
+			b = new buffer;
+			b->name = me.name;
+			b->tid = r.next_tid++;
+			b->next_id = 0;
+			b->alive = true;
+			r.buffers.push_back(std::unique_ptr<buffer>(b));
+			me.buf = b;
+		}
+		b->generation = r.generation.load(std::memory_order_relaxed);
+		b->capacity = r.capacity;
+		b->events.reset(new event[r.capacity]);
+		b->head.store(0, std::memory_order_relaxed);
+		return b;
+	}
+
+	AGO_INLINE void write_event(std::ostream &out, bool &first, const char *fmt, ...)
+	{
+		char line[256];
+		va_list args;
+		va_start(args, fmt);
+		vsnprintf(line, sizeof(line), fmt, args);
+		va_end(args);
+
+		out << (first ? "\n" : ",\n") << line;
+		first = false;
+	}
+
+	/* s as the contents of a JSON string */
+	AGO_INLINE std::string json_escape(const std::string &s)
+	{
+		std::string escaped;
+		for(auto c = s.begin(); c != s.end(); ++c)
+		{
+			unsigned char u = (unsigned char)*c;
+			if(u == '"' || u == '\\')
+			{
+				escaped += '\\';
+				escaped += *c;
+			}
+			else if(u < 0x20)
+			{
+				char code[8];
+				snprintf(code, sizeof(code), "\\u%04x", u);
+				escaped += code;
+			}
+			else escaped += *c;
+		}
+		return escaped;
+	}
+}
+
+AGO_INLINE void ago_trace::start(std::size_t events_per_thread)
+{
+	ago_trace_detail::registry_state &r = ago_trace_detail::registry();
+	std::lock_guard<std::mutex> lock(r.m);
+
+	r.capacity = events_per_thread < 2 ? 2 : events_per_thread;
+
+	/* forget threads that have gone */
+	for(auto b = r.buffers.begin(); b != r.buffers.end(); )
+	{
+		if((*b)->alive.load()) ++b;
+		else b = r.buffers.erase(b);
+	}
+
+	r.epoch_ns.store(ago_trace_detail::now_ns(), std::memory_order_relaxed);
+	r.generation.fetch_add(1, std::memory_order_release);
+	on().store(true);
+}
+
+AGO_INLINE void ago_trace::stop()
+{
+	on().store(false);
+}
+
+AGO_INLINE void ago_trace::name_thread(const std::string &name)
+{
+	ago_trace_detail::thread_state &me = ago_trace_detail::self();
+	me.name = name;
+	if(me.buf)
+	{
+		std::lock_guard<std::mutex> lock(ago_trace_detail::registry().m);
+		me.buf->name = name;
+	}
+}
+
+AGO_INLINE void ago_trace::record(event_type type, std::uint64_t arg)
+{
+	ago_trace_detail::buffer *b = ago_trace_detail::own_buffer();
+	std::uint64_t h = b->head.load(std::memory_order_relaxed);
+	ago_trace_detail::event &e = b->events[h % b->capacity];
+	e.ts.store(ago_trace_detail::now_ns(), std::memory_order_relaxed);
+	e.arg.store(arg, std::memory_order_relaxed);
+	e.type.store(type, std::memory_order_relaxed);
+	b->head.store(h + 1, std::memory_order_release);
+}
+
+AGO_INLINE std::uint64_t ago_trace::record_submit()
+{
+	ago_trace_detail::buffer *b = ago_trace_detail::own_buffer();
+	std::uint64_t id = (b->tid << 40) | (++b->next_id & ((std::uint64_t(1) << 40) - 1));
+	record(submit, id);
+	return id;
+}
+
+AGO_INLINE void ago_trace::write(std::ostream &out)
+{
+	using namespace ago_trace_detail;
+
+	registry_state &r = registry();
+	std::lock_guard<std::mutex> lock(r.m);
+	std::uint64_t epoch = r.epoch_ns.load(std::memory_order_relaxed);
+	bool first = true;
+
+	out << "{\"traceEvents\":[";
+
+	for(auto bp = r.buffers.begin(); bp != r.buffers.end(); ++bp)
+	{
+		buffer &b = **bp;
+		unsigned long long tid = (unsigned long long)b.tid;
+
+		if(!b.name.empty())
+		{
+			/* names can be any length, so not through write_event() */
+			out << (first ? "\n" : ",\n")
+				<< "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+				<< ",\"args\":{\"name\":\"" << json_escape(b.name) << "\"}}";
+			first = false;
+		}
+		if(!b.events) continue;
+
+		/* copy what is there, then drop anything overwritten meanwhile */
+		std::uint64_t head = b.head.load(std::memory_order_acquire);
+		std::uint64_t from = head > b.capacity ? head - b.capacity : 0;
+		struct copied { std::uint64_t ts, arg; std::uint32_t type; };
+		std::vector<copied> events;
+		for(std::uint64_t i = from; i < head; ++i)
+		{
+			const event &e = b.events[i % b.capacity];
+			copied c = { e.ts.load(std::memory_order_relaxed),
+				e.arg.load(std::memory_order_relaxed),
+				e.type.load(std::memory_order_relaxed) };
+			events.push_back(c);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		std::uint64_t after = b.head.load(std::memory_order_relaxed);
+		std::uint64_t valid = after > b.capacity ? after - b.capacity : 0;
+		std::size_t skip = valid > from ? (std::size_t)std::min(valid - from, head - from) : 0;
+
+		for(auto c = events.begin() + skip; c != events.end(); ++c)
+		{
+			if(c->ts < epoch) continue;
+			double ts = (c->ts - epoch) / 1000.0;
+			unsigned long long arg = (unsigned long long)c->arg;
+
+			switch(c->type)
+			{
+			case submit:
+				write_event(out, first,
+					"{\"name\":\"go\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu,"
+					"\"args\":{\"id\":%llu}}", ts, tid, arg);
+				write_event(out, first,
+					"{\"name\":\"task\",\"cat\":\"ago\",\"ph\":\"s\",\"id\":%llu,\"ts\":%.3f,"
+					"\"pid\":1,\"tid\":%llu}", arg, ts, tid);
+				break;
+			case run_begin:
+				write_event(out, first,
+					"{\"name\":\"task\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu,"
+					"\"args\":{\"id\":%llu}}", ts, tid, arg);
+				if(arg)
+				{
+					write_event(out, first,
+						"{\"name\":\"task\",\"cat\":\"ago\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%llu,"
+						"\"ts\":%.3f,\"pid\":1,\"tid\":%llu}", arg, ts, tid);
+				}
+				break;
+			case run_end:
+				write_event(out, first,
+					"{\"name\":\"task\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu}", ts, tid);
+				break;
+			case steal:
+				write_event(out, first,
+					"{\"name\":\"steal\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu,"
+					"\"args\":{\"id\":%llu}}", ts, tid, arg);
+				break;
+			case park:
+				write_event(out, first,
+					"{\"name\":\"parked\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu}", ts, tid);
+				break;
+			case unpark:
+				write_event(out, first,
+					"{\"name\":\"parked\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu}", ts, tid);
+				break;
+			case wake:
+				write_event(out, first,
+					"{\"name\":\"wake\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%llu,"
+					"\"args\":{\"thread\":%llu}}", ts, tid, arg);
+				break;
+			}
+		}
+	}
+
+	out << "\n]}\n";
+}
+
+#endif	/* AGO_TRACE_IMPL_H */
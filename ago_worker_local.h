@@ -0,0 +1,117 @@
+#ifndef AGO_WORKER_LOCAL_H
+#define AGO_WORKER_LOCAL_H
+
+/* One instance of T per thread of an ago pool.
+ *
+ * local() returns the calling thread's instance, constructing it on first
+ * use, so functions can accumulate into it without any locking. Each
+ * instance sits on its own cache lines. Once the functions are finished
+ * (after ago::wait()), for_each() visits every instance that was
+ * constructed, to combine them.
+ *
+ * Threads outside the pool, go_blocking() threads among them, each get an
+ * instance of their own too, which local() looks up under a lock, since
+ * they have no slot of their own and many of them may run at once.
+ *
+ * Pool is the pool type: ago unless it is a basic_ago with other policies.
+ */
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <cstddef>
+
+#include "ago.h"
+
+template<class T, class Pool = ago>
+class ago_worker_local
+{
+public:
+	explicit ago_worker_local(Pool &pool)
+		: pool(pool), make([]{ return T(); }), slots(pool.worker_slots())
+	{
+	}
+
+	/* make() builds each instance */
+	ago_worker_local(Pool &pool, std::function<T()> make)
+		: pool(pool), make(std::move(make)), slots(pool.worker_slots())
+	{
+	}
+
+	~ago_worker_local()
+	{
+		for(auto s = slots.begin(); s != slots.end(); ++s)
+		{
+			if(s->constructed) s->get()->~T();
+		}
+	}
+
+	T &local()
+	{
+		int index = pool.worker_index();
+		if(index < 0) return outside_local();
+
+		slot &s = slots[index];
+		if(!s.constructed)
+		{
+			new(&s.storage) T(make());
+			s.constructed = true;
+		}
+		return *s.get();
+	}
+
+	/* call f(T &) for each constructed instance; not while functions may
+	 * still be using them */
+	template<class F>
+	void for_each(F f)
+	{
+		for(auto s = slots.begin(); s != slots.end(); ++s)
+		{
+			if(s->constructed) f(*s->get());
+		}
+		for(auto o = outside.begin(); o != outside.end(); ++o)
+		{
+			f(*o->second);
+		}
+	}
+
+private:
+	ago_worker_local(const ago_worker_local &);
+	ago_worker_local &operator=(const ago_worker_local &);
+
+	T &outside_local()
+	{
+		std::lock_guard<std::mutex> lock(outside_mutex);
+		std::unique_ptr<T> &t = outside[std::this_thread::get_id()];
+		if(!t) t.reset(new T(make()));
+		return *t;
+	}
+
+	struct slot
+	{
+		slot() : constructed(false) {}
+
+		T *get() { return reinterpret_cast<T*>(&storage); }
+
+		/* keep neighbouring instances off each other's cache lines */
+		char pad_before[64];
+		typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+		bool constructed;
+		char pad_after[64];
+	};
+
+	Pool &pool;
+	std::function<T()> make;
+	std::vector<slot> slots;
+
+	/* instances for threads outside the pool, by thread */
+	std::mutex outside_mutex;
+	std::unordered_map<std::thread::id, std::unique_ptr<T>> outside;
+};
+
+#endif	/* AGO_WORKER_LOCAL_H */